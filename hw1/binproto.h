@@ -0,0 +1,34 @@
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <stdint.h>
+
+// Binary protocol, served on the port given to -B. There are no prompts: a
+// client sends fixed-size little-endian requests, pipelined if it likes, and
+// gets one BinReply per id back in order. BIN_BATCH_LOOKUP is followed by
+// count int32 ids and answered with count replies.
+enum { BIN_LOOKUP = 1, BIN_ORDER = 2, BIN_BATCH_LOOKUP = 3 };
+enum { BIN_ADULT = 0, BIN_CHILDREN = 1 };  // BinRequest.type
+enum { BIN_OK = 0, BIN_FAILED = 1, BIN_LOCKED = 2 };  // BinReply.status
+#define BIN_BATCH_MAX 64  // ids per BIN_BATCH_LOOKUP
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;     // BIN_ORDER: mask type
+    uint16_t count;   // BIN_BATCH_LOOKUP: ids following the request
+    int32_t id;       // BIN_LOOKUP, BIN_ORDER
+    int32_t amount;   // BIN_ORDER: masks to order
+} BinRequest;
+
+typedef struct {
+    uint8_t status;
+    uint8_t pad[3];
+    int32_t id;
+    int32_t adultMask;  // masks left, after the order for BIN_ORDER
+    int32_t childrenMask;
+} BinReply;
+
+_Static_assert(sizeof(BinRequest) == 12, "BinRequest is 12 bytes on the wire");
+_Static_assert(sizeof(BinReply) == 16, "BinReply is 16 bytes on the wire");
+
+#endif
@@ -0,0 +1,214 @@
+// Drive libcsiemask from many threads of one process, without sockets, to
+// see what the record file and the locks cost by themselves, e.g.
+//   ./corebench -t 8 -w 10 -n 100000 -d 5
+// A scratch record file of -n records is made in /tmp and removed after.
+// Every thread runs lookUpCsieMask() or, for -w percent of the operations,
+// orderCsieMask() of one mask, on ids drawn uniformly from all records or
+// from the first -k ones to make them contend. -l locks through the shared
+// lock table instead of fcntl(), as the servers do with -l.
+// The report is a line of key=value pairs, then the latency of each kind of
+// operation in nanoseconds.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csiemask.h"
+#include "metrics.h"
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+#define FIRST_ID 902001
+#define STOCK (1 << 30)  // masks of each kind, no order runs out
+
+typedef struct {
+    pthread_t thread;
+    uint64_t rng;
+    uint64_t outcomes[CM_ERROR + 1];
+    Histogram lookups, orders;
+} Worker;
+
+CsieMask db;
+int nRecords = 100000;
+int nHot = 0;  // -k: ids drawn from the first nHot records, 0 for all
+int writePct = 0;
+atomic_bool stop;
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next(uint64_t* rng) {
+    // xorshift64*
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return *rng * 2685821657736338717ull;
+}
+
+static void* work(void* arg) {
+    Worker* w = (Worker*)arg;
+    int span = nHot > 0 ? nHot : nRecords;
+    Order order;
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        uint64_t r = next(&w->rng);
+        int id = FIRST_ID + (int)(r % span);
+        bool write = (r >> 32) % 100 < (uint64_t)writePct;
+        uint64_t start = nowNs();
+        MaskKind kind = (r >> 40) & 1 ? CM_ADULT : CM_CHILDREN;
+        CmResult res = write ? orderCsieMask(&db, id, kind, 1, &order)
+                             : lookUpCsieMask(&db, id, &order);
+        recordHistogram(write ? &w->orders : &w->lookups, nowNs() - start);
+        ++w->outcomes[res];
+    }
+    return NULL;
+}
+
+// the scratch file: nRecords records with ids from FIRST_ID
+static void makeRecords(const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        ERR_EXIT(path);
+    Order* orders = (Order*)malloc(sizeof(Order) * nRecords);
+    if (orders == NULL)
+        ERR_EXIT("malloc");
+    for (int i = 0; i < nRecords; ++i)
+        orders[i] = (Order){FIRST_ID + i, STOCK, STOCK};
+    size_t size = sizeof(Order) * nRecords;
+    if (write(fd, orders, size) != (ssize_t)size)
+        ERR_EXIT(path);
+    close(fd);
+    free(orders);
+}
+
+int main(int argc, char* argv[]) {
+    int nThreads = 4, opt;
+    double duration = 5;
+    bool useLockTable = false;
+    while ((opt = getopt(argc, argv, "d:k:ln:t:w:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'k':
+            nHot = atoi(optarg);
+            break;
+        case 'l':
+            useLockTable = true;
+            break;
+        case 'n':
+            nRecords = atoi(optarg);
+            break;
+        case 't':
+            nThreads = atoi(optarg);
+            break;
+        case 'w':
+            writePct = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc || duration <= 0 || nRecords <= 0 || nHot < 0 ||
+        nHot > nRecords || nThreads <= 0 || writePct < 0 || writePct > 100) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-d seconds] [-k hot records] [-l] [-n records] "
+                "[-t threads] [-w write%%]\n",
+                argv[0]);
+        exit(1);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/corebench.%d", (int)getpid());
+    makeRecords(path);
+    if (openCsieMask(&db, path) < 0)
+        ERR_EXIT(path);
+    char segment[64] = "";
+    if (useLockTable) {
+        if (attachLockTable(&db.table, db.fd, db.len) < 0)
+            ERR_EXIT("failed to attach the shared lock table");
+        // named by locktable.c after the file, which goes away with us
+        struct stat status;
+        fstat(db.fd, &status);
+        snprintf(segment, sizeof(segment), "/csieMask.%lx.%lx",
+                 (unsigned long)status.st_dev, (unsigned long)status.st_ino);
+    }
+
+    Worker* workers = (Worker*)calloc(nThreads, sizeof(Worker));
+    if (workers == NULL)
+        ERR_EXIT("calloc");
+    uint64_t start = nowNs();
+    for (int i = 0; i < nThreads; ++i) {
+        workers[i].rng = (start + i * 0x9e3779b97f4a7c15ull) | 1;
+        int err = pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+        if (err != 0) {
+            errno = err;
+            ERR_EXIT("pthread_create");
+        }
+    }
+    struct timespec pause = {(time_t)duration,
+                             (long)((duration - (time_t)duration) * 1e9)};
+    while (nanosleep(&pause, &pause) < 0 && errno == EINTR)
+        ;
+    atomic_store(&stop, true);
+    uint64_t outcomes[CM_ERROR + 1] = {0};
+    static Histogram lookups, orders;
+    for (int i = 0; i < nThreads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        for (int k = 0; k <= CM_ERROR; ++k)
+            outcomes[k] += workers[i].outcomes[k];
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            lookups.buckets[b] += workers[i].lookups.buckets[b];
+            orders.buckets[b] += workers[i].orders.buckets[b];
+        }
+        lookups.count += workers[i].lookups.count;
+        lookups.sum += workers[i].lookups.sum;
+        if (workers[i].lookups.max > lookups.max)
+            lookups.max = workers[i].lookups.max;
+        orders.count += workers[i].orders.count;
+        orders.sum += workers[i].orders.sum;
+        if (workers[i].orders.max > orders.max)
+            orders.max = workers[i].orders.max;
+    }
+    double secs = (nowNs() - start) * 1e-9;
+
+    uint64_t ops = lookups.count + orders.count;
+    printf("threads=%d records=%d hot=%d write_pct=%d lock_table=%d "
+           "seconds=%.2f ops=%llu ops_per_s=%.0f ok=%llu locked=%llu "
+           "failed=%llu errors=%llu\n",
+           nThreads, nRecords, nHot, writePct, useLockTable, secs,
+           (unsigned long long)ops, ops / secs,
+           (unsigned long long)outcomes[CM_SUCCESS],
+           (unsigned long long)outcomes[CM_LOCKED],
+           (unsigned long long)outcomes[CM_FAILED],
+           (unsigned long long)outcomes[CM_ERROR]);
+    char line[256];
+    formatHistogram(line, sizeof(line), &lookups);
+    printf("lookup %s\n", line);
+    formatHistogram(line, sizeof(line), &orders);
+    printf("order %s\n", line);
+
+    closeCsieMask(&db);
+    if (segment[0])
+        shm_unlink(segment);
+    unlink(path);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,129 @@
+# Feed commands to read_server/write_server in fragments and check that the
+# replies are the same as for whole commands.
+#   python3 csieMask-trickle.py [port]
+import shutil
+import socket
+import subprocess
+import sys
+import time
+
+PROMPT_ID = "Please enter the id (to check how many masks can be ordered):\n"
+PROMPT_ORDER = "Please enter the mask type (adult or children) and number of mask you would like to order:\n"
+FAILED = "Operation failed.\n"
+GRACE_MS = 50  # the default of -G
+
+
+def can_order(adult, children):
+	return "You can order %d adult mask(s) and %d children mask(s).\n" % (adult, children)
+
+
+def ordered(id_, n, kind):
+	return "Pre-order for %d successed, %d %s mask(s) ordered.\n" % (id_, n, kind)
+
+
+class Client:
+	def __init__(self, port):
+		self.sock = socket.create_connection(("localhost", port))
+		# every send() becomes its own segment
+		self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+		self.sock.settimeout(1)
+		self.data = b""
+
+	def trickle(self, data, delay=0.001):
+		for i in range(len(data)):
+			self.sock.send(data[i:i + 1])
+			time.sleep(delay)
+
+	def send(self, data):
+		self.sock.sendall(data)
+
+	def line(self):
+		while b"\n" not in self.data:
+			chunk = self.sock.recv(512)
+			if not chunk:
+				break
+			self.data += chunk
+		line, sep, self.data = self.data.partition(b"\n")
+		return (line + sep).decode()
+
+
+class Trickle:
+	def __init__(self, port):
+		self.read_port = port
+		self.write_port = port + 1
+		self.grace_port = port + 2  # read_server with the default grace period
+		self.failed = 0
+
+	def expect(self, name, got, want):
+		if got != want:
+			self.failed += 1
+			print("\033[91m%s failed: expected %r, got %r\033[0m" % (name, want, got))
+		else:
+			print("\33[32m%s ok\33[0m" % name)
+
+	def run(self):
+		c = Client(self.read_port)
+		self.expect("read prompt", c.line(), PROMPT_ID)
+		c.trickle(b"902001\n")
+		self.expect("read, one byte per segment", c.line(), can_order(10, 10))
+
+		c = Client(self.write_port)
+		c.line()
+		c.trickle(b"902002\r\n")
+		self.expect("write id, one byte per segment", c.line(), can_order(10, 10))
+		self.expect("write order prompt", c.line(), PROMPT_ORDER)
+		c.trickle(b"children 3\r\n")
+		self.expect("write order, one byte per segment", c.line(), ordered(902002, 3, "children"))
+
+		c = Client(self.write_port)
+		c.send(b"902003\nadult 4\n")
+		self.expect("pipelined id", c.line(), PROMPT_ID)
+		self.expect("pipelined lookup", c.line(), can_order(10, 10))
+		c.line()
+		self.expect("pipelined order", c.line(), ordered(902003, 4, "adult"))
+
+		c = Client(self.read_port)
+		c.line()
+		c.send(b"9" * 600)
+		self.expect("oversize line", c.line(), FAILED)
+
+		c = Client(self.write_port)
+		c.line()
+		c.send(b"902004\n")
+		c.line()
+		c.line()
+		c.send(b"adult 1")
+		time.sleep(GRACE_MS * 2.4 / 1000)  # the rest comes much later
+		c.send(b"0\n")
+		self.expect("order split by a pause", c.line(), ordered(902004, 10, "adult"))
+
+		c = Client(self.grace_port)
+		c.line()
+		c.trickle(b"902002")  # no newline, like csieMask-score.py
+		self.expect("unterminated id", c.line(), can_order(10, 7))
+		return self.failed
+
+
+def main():
+	port = int(sys.argv[1]) if len(sys.argv) > 1 else 7985
+	subprocess.run(["make"], check=True)
+	shutil.copy("preorderRecord", "preorderRecord_trickle")
+	servers = []
+	try:
+		# -G 0: fragments must wait for the newline however slowly they come
+		for args in (["./read_server", "-G", "0", str(port)],
+				["./write_server", "-G", "0", str(port + 1)],
+				["./read_server", str(port + 2)]):
+			servers.append(subprocess.Popen(args, stderr=subprocess.DEVNULL))
+		time.sleep(0.2)
+		failed = Trickle(port).run()
+	finally:
+		for server in servers:
+			server.terminate()
+			server.wait()
+		shutil.move("preorderRecord_trickle", "preorderRecord")
+	sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,337 @@
+#include "csiemask.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HELD_WRITER 0x80000000u
+#define HELD_BUSY 0x40000000u  // a thread is taking or dropping the lock
+#define CLEARS_PER_RECORD 16  // slots of a new index cleared for the cost of
+                              // indexing a record
+
+static int readAll(int fd, void* buf, size_t count, off_t offset) {
+    char* bufPtr = (char*)buf;
+    while (count) {
+        ssize_t ret = pread(fd, bufPtr, count, offset);
+        if (ret > 0) {
+            count -= ret;
+            bufPtr += ret;
+            offset += ret;
+        } else if (ret == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int lockFile(int fd, short type, off_t offset, off_t len, bool wait) {
+    struct flock lock = {
+        .l_type = type, .l_whence = SEEK_SET, .l_start = offset, .l_len = len
+        // omit l_pid
+    };
+    int ret;
+    do {
+        ret = fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock);
+    } while (ret < 0 && wait && errno == EINTR);
+    return ret;
+}
+
+// minId..maxId of the records first..last
+static void spanOfIds(const Order* orders, int first, int last, int* minId,
+                      int* maxId) {
+    *minId = first < last ? abs(orders[first].id) : 0;
+    *maxId = *minId;
+    for (int i = first + 1; i < last; ++i) {
+        int id = abs(orders[i].id);
+        *minId = id < *minId ? id : *minId;
+        *maxId = id > *maxId ? id : *maxId;
+    }
+}
+
+int openCsieMask(CsieMask* db, const char* path) {
+    memset(db, 0, sizeof(CsieMask));
+    do {
+        db->fd = open(path, O_RDWR);
+    } while (db->fd < 0 && errno == EINTR);
+    if (db->fd < 0)
+        return -1;
+
+    // no writer in the middle of a record while it is read
+    lockFile(db->fd, F_RDLCK, 0, 0, true);
+    struct stat status;
+    int ret = fstat(db->fd, &status);
+    if (ret == 0) {
+        db->len = db->cap = status.st_size / sizeof(Order);
+        db->orders = (Order*)malloc(sizeof(Order) * (db->cap ? db->cap : 1));
+        db->held = (_Atomic uint32_t*)calloc(db->cap ? db->cap : 1,
+                                             sizeof(*db->held));
+        ret = db->orders && db->held
+                  ? readAll(db->fd, db->orders, sizeof(Order) * db->len, 0)
+                  : -1;
+    }
+    lockFile(db->fd, F_UNLCK, 0, 0, true);
+
+    int minId, maxId;
+    spanOfIds(db->orders, 0, ret == 0 ? db->len : 0, &minId, &maxId);
+    if (ret < 0 || initIdIndex(&db->index, minId, maxId, db->len) < 0) {
+        int err = errno;
+        closeCsieMask(db);
+        errno = err;
+        return -1;
+    }
+    for (int i = 0; i < db->len; ++i)
+        insertIdIndex(&db->index, abs(db->orders[i].id), i);
+    db->indexed = db->len;
+    return 0;
+}
+
+void closeCsieMask(CsieMask* db) {
+    detachLockTable(&db->table);
+    freeIdIndex(&db->index);
+    freeIdIndex(&db->grown);
+    free(db->orders);
+    free((void*)db->held);
+    if (db->fd >= 0)
+        close(db->fd);
+    memset(db, 0, sizeof(CsieMask));
+    db->fd = -1;
+}
+
+int growCsieMask(CsieMask* db, int max,
+                 int (*extend)(CsieMask* db, int len, void* arg), void* arg) {
+    struct stat status;
+    if (fstat(db->fd, &status) < 0)
+        return -1;
+    int len = status.st_size / sizeof(Order);
+    if (max > 0 && len - db->len > max)
+        len = db->len + max;
+    if (len <= db->len)
+        return 0;
+    if (len > db->cap) {
+        int cap = len > db->cap * 2 ? len : db->cap * 2;
+        Order* orders = (Order*)realloc(db->orders, sizeof(Order) * cap);
+        if (orders == NULL)
+            return -1;
+        db->orders = orders;
+        _Atomic uint32_t* held = (_Atomic uint32_t*)realloc(
+            (void*)db->held, sizeof(*held) * cap);
+        if (held == NULL)
+            return -1;
+        db->held = held;
+        db->cap = cap;
+    }
+
+    if (readAll(db->fd, &db->orders[db->len], sizeof(Order) * (len - db->len),
+                (off_t)db->len * sizeof(Order)) < 0)
+        return -1;
+    if (db->table.slots && growLockTable(&db->table, len) < 0)
+        return -1;
+    if (extend && extend(db, len, arg) < 0)
+        return -1;
+    int minId, maxId;
+    spanOfIds(db->orders, db->len, len, &minId, &maxId);
+    if (db->indexed < db->len) {
+        minId = db->tailMinId < minId ? db->tailMinId : minId;
+        maxId = db->tailMaxId > maxId ? db->tailMaxId : maxId;
+    }
+    db->tailMinId = minId;
+    db->tailMaxId = maxId;
+    for (int i = db->len; i < len; ++i)
+        atomic_init(&db->held[i], 0);
+    int added = len - db->len;
+    db->len = len;
+    return added;
+}
+
+int indexCsieMask(CsieMask* db, int max) {
+    int budget = max > 0 ? max : INT_MAX;
+    while (budget > 0 && db->indexed < db->len) {
+        if (db->grown.values == NULL &&
+            !hasRoomIdIndex(&db->index, db->tailMinId, db->tailMaxId,
+                            db->len)) {
+            if (initGrownIdIndex(&db->grown, &db->index, db->tailMinId,
+                                 db->tailMaxId, db->len) < 0)
+                return -1;
+            db->grownCleared = 0;
+            db->grownLen = 0;
+            db->grownEnd = db->len;
+        }
+        if (db->grown.values && db->grownCleared < db->grown.cap) {
+            size_t n = db->grown.cap - db->grownCleared;
+            if (n > (size_t)budget * CLEARS_PER_RECORD)
+                n = (size_t)budget * CLEARS_PER_RECORD;
+            memset(&db->grown.values[db->grownCleared], 0xff, sizeof(int) * n);
+            if (db->grown.keys)  // fault its pages in now rather than later
+                memset(&db->grown.keys[db->grownCleared], 0, sizeof(int) * n);
+            db->grownCleared += n;
+            budget -= (n + CLEARS_PER_RECORD - 1) / CLEARS_PER_RECORD;
+            continue;
+        }
+        IdIndex* index = db->grown.values ? &db->grown : &db->index;
+        int* next = db->grown.values ? &db->grownLen : &db->indexed;
+        int end = db->grown.values ? db->grownEnd : db->len;
+        int n = end - *next < budget ? end - *next : budget;
+        for (int i = *next; i < *next + n; ++i)
+            insertIdIndex(index, abs(db->orders[i].id), i);
+        *next += n;
+        budget -= n;
+        if (db->grown.values && db->grownLen == db->grownEnd) {
+            // the records past grownEnd stay in the span, no harm
+            freeIdIndex(&db->index);
+            db->index = db->grown;
+            memset(&db->grown, 0, sizeof(IdIndex));
+            db->indexed = db->grownEnd;
+        }
+    }
+    return db->len - db->indexed;
+}
+
+int scanCsieMask(const CsieMask* db, int id) {
+    if (id < db->tailMinId || id > db->tailMaxId)
+        return -1;
+    for (int i = db->indexed; i < db->len; ++i)
+        if (abs(db->orders[i].id) == id)
+            return i;
+    return -1;
+}
+
+int readCsieMask(CsieMask* db, int idx, Order* order) {
+    return readAll(db->fd, order, sizeof(Order), (off_t)idx * sizeof(Order));
+}
+
+int writeCsieMask(CsieMask* db, int idx, const Order* order) {
+    if (db->table.slots)
+        beginUpdateLockTable(&db->table, idx);
+    int ret;
+    do {
+        ret = pwrite(db->fd, order, sizeof(Order), (off_t)idx * sizeof(Order));
+    } while (ret < 0 && errno == EINTR);
+    if (db->table.slots)
+        endUpdateLockTable(&db->table, idx);
+    return ret == sizeof(Order) ? 0 : -1;
+}
+
+int lockCsieMask(CsieMask* db, int idx, bool write, bool upgrade) {
+    if (db->table.slots)
+        return write ? tryWriteLockTable(&db->table, idx, upgrade)
+                     : tryReadLockTable(&db->table, idx);
+    return lockFile(db->fd, write ? F_WRLCK : F_RDLCK,
+                    (off_t)idx * sizeof(Order), sizeof(Order), false);
+}
+
+int unlockCsieMask(CsieMask* db, int idx, bool write) {
+    if (db->table.slots)
+        return unlockTable(&db->table, idx, write);
+    return lockFile(db->fd, F_UNLCK, (off_t)idx * sizeof(Order),
+                    sizeof(Order), false);
+}
+
+// The lock of the record for the calling thread. The table counts readers
+// and refuses a second writer of the same process, fcntl() does neither:
+// the first reader in takes the lock for all of them and the last one out
+// drops it.
+static CmResult holdRecord(CsieMask* db, int idx, bool write) {
+    if (db->table.slots) {
+        if (lockCsieMask(db, idx, write, false) == 0)
+            return CM_SUCCESS;
+        return errno == EAGAIN ? CM_LOCKED : CM_ERROR;
+    }
+    _Atomic uint32_t* word = &db->held[idx];
+    uint32_t seen = atomic_load(word);
+    for (;;) {
+        if (seen & HELD_BUSY) {
+            sched_yield();  // the other thread is in fcntl()
+            seen = atomic_load(word);
+        } else if ((seen & HELD_WRITER) || (write && seen)) {
+            return CM_LOCKED;
+        } else if (seen) {
+            if (atomic_compare_exchange_weak(word, &seen, seen + 1))
+                return CM_SUCCESS;
+        } else if (atomic_compare_exchange_weak(word, &seen, HELD_BUSY)) {
+            break;
+        }
+    }
+    if (lockCsieMask(db, idx, write, false) < 0) {
+        int err = errno;
+        atomic_store(word, 0);
+        errno = err;
+        return err == EAGAIN || err == EACCES ? CM_LOCKED : CM_ERROR;
+    }
+    atomic_store(word, write ? HELD_WRITER : 1);
+    return CM_SUCCESS;
+}
+
+static void releaseRecord(CsieMask* db, int idx, bool write) {
+    if (db->table.slots || write) {
+        unlockCsieMask(db, idx, write);
+        if (!db->table.slots)
+            atomic_store(&db->held[idx], 0);
+        return;
+    }
+    _Atomic uint32_t* word = &db->held[idx];
+    uint32_t seen = atomic_load(word);
+    for (;;) {
+        if (seen != 1) {
+            if (atomic_compare_exchange_weak(word, &seen, seen - 1))
+                return;
+        } else if (atomic_compare_exchange_weak(word, &seen, HELD_BUSY)) {
+            unlockCsieMask(db, idx, false);
+            atomic_store(word, 0);
+            return;
+        }
+    }
+}
+
+CmResult lookUpCsieMask(CsieMask* db, int id, Order* order) {
+    int idx = indexOfCsieMask(db, id);
+    if (idx < 0)
+        return CM_FAILED;
+    if (db->table.slots) {
+        // seqlock: no lock is taken, retry if a writer got in between
+        uint64_t seq;
+        do {
+            if (beginSnapshotLockTable(&db->table, idx, &seq) < 0)
+                return CM_LOCKED;
+            if (readCsieMask(db, idx, order) < 0)
+                return CM_ERROR;
+        } while (!endSnapshotLockTable(&db->table, idx, seq));
+        return CM_SUCCESS;
+    }
+    CmResult res = holdRecord(db, idx, false);
+    if (res != CM_SUCCESS)
+        return res;
+    res = readCsieMask(db, idx, order) < 0 ? CM_ERROR : CM_SUCCESS;
+    releaseRecord(db, idx, false);
+    return res;
+}
+
+CmResult orderCsieMask(CsieMask* db, int id, MaskKind kind, int count,
+                       Order* order) {
+    int idx = indexOfCsieMask(db, id);
+    if (idx < 0 || count <= 0)
+        return CM_FAILED;
+    CmResult res = holdRecord(db, idx, true);
+    if (res != CM_SUCCESS)
+        return res;
+    if (readCsieMask(db, idx, order) < 0) {
+        res = CM_ERROR;
+    } else {
+        int* left = kind == CM_ADULT ? &order->adultMask : &order->childrenMask;
+        if (*left < count) {
+            res = CM_FAILED;
+        } else {
+            *left -= count;
+            if (writeCsieMask(db, idx, order) < 0)
+                res = CM_ERROR;
+            else
+                db->orders[idx] = *order;
+        }
+    }
+    releaseRecord(db, idx, true);
+    return res;
+}
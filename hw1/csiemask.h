@@ -0,0 +1,96 @@
+#ifndef CSIEMASK_H
+#define CSIEMASK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "idindex.h"
+#include "locktable.h"
+
+// libcsiemask: the record file, the id index and the record locks of the
+// servers behind one context, so that they can be driven without sockets.
+//
+// openCsieMask() reads the whole file under a read lock and indexes it.
+// The lower level calls (growCsieMask() to lockCsieMask()) are what the
+// servers use from their single thread: they read and write the file and
+// take the lock of a record for this process, with fcntl() or, once
+// table is attached with attachLockTable(), the shared lock table.
+// lookUpCsieMask() and orderCsieMask() are whole transactions that any
+// number of threads may run at once, as long as growCsieMask() and
+// indexCsieMask() do not.
+
+typedef struct {
+    int id;  // 902001-902020, customer id, set to negative if this process
+             // have write lock on the section
+    int adultMask;     // set to 10 by default
+    int childrenMask;  // set to 10 by default
+} Order;
+
+typedef struct {
+    int fd;         // the record file
+    Order* orders;  // as last read or written by this process
+    int len;        // records in orders
+    int cap;        // records orders and held can hold
+    IdIndex index;  // id -> index of orders[0..indexed)
+    // Records taken in by growCsieMask() are scanned for until
+    // indexCsieMask() has indexed them, a few at a time.
+    int indexed;
+    int tailMinId, tailMaxId;  // span of the ids of orders[indexed..len)
+    // An index that is too small is replaced by grown: its values are
+    // cleared up to grownCleared first, then it is filled from
+    // orders[0..grownLen) until grownLen reaches grownEnd.
+    IdIndex grown;  // grown.values is NULL unless that is under way
+    size_t grownCleared;
+    int grownLen, grownEnd;
+    LockTable table;  // table.slots is NULL unless attached
+    // lookUpCsieMask()/orderCsieMask() with fcntl(): fcntl() locks belong to
+    // the process, the threads in it take turns on a record through these
+    _Atomic uint32_t* held;
+} CsieMask;
+
+typedef enum {
+    CM_SUCCESS,
+    CM_FAILED,  // unknown id or not enough masks left
+    CM_LOCKED,  // another thread or process holds the record
+    CM_ERROR,   // see errno
+} CmResult;
+
+typedef enum { CM_ADULT, CM_CHILDREN } MaskKind;
+
+int openCsieMask(CsieMask* db, const char* path);
+void closeCsieMask(CsieMask* db);
+// Take in the records appended to the file since it was last read, at most
+// max of them, 0 for all. Before they are published extend() is called with
+// the new length, for the caller to grow the arrays it keeps beside orders
+// up to cap; nothing changes if it returns -1. Returns the number of new
+// records, 0 if there are none. They are found by a scan until indexed.
+int growCsieMask(CsieMask* db, int max,
+                 int (*extend)(CsieMask* db, int len, void* arg), void* arg);
+// Index at most max more of the records taken in, 0 for all of them. A
+// bigger index is built over as many calls when the current one is full.
+// Returns the number of records left to index, -1 on error.
+int indexCsieMask(CsieMask* db, int max);
+// indexOfCsieMask() for the records not indexed yet
+int scanCsieMask(const CsieMask* db, int id);
+// pread()/pwrite() of one record, the write inside the seqlock of the table
+int readCsieMask(CsieMask* db, int idx, Order* order);
+int writeCsieMask(CsieMask* db, int idx, const Order* order);
+// Lock of the record of idx for this process, fails with EAGAIN or EACCES
+// while another process holds it. upgrade: this process holds the read lock.
+int lockCsieMask(CsieMask* db, int idx, bool write, bool upgrade);
+int unlockCsieMask(CsieMask* db, int idx, bool write);
+
+// Thread-safe, from the file: the record of id, and an order of count masks
+// of kind that is written only if that many are left. order gets the record
+// as it is afterwards unless CM_LOCKED or CM_ERROR is returned.
+CmResult lookUpCsieMask(CsieMask* db, int id, Order* order);
+CmResult orderCsieMask(CsieMask* db, int id, MaskKind kind, int count,
+                       Order* order);
+
+static inline int indexOfCsieMask(const CsieMask* db, int id) {
+    int idx = lookUpIdIndex(&db->index, id);
+    return idx >= 0 || db->indexed == db->len ? idx : scanCsieMask(db, id);
+}
+
+#endif
@@ -0,0 +1,118 @@
+#include "feed.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FEED_MASK (FEED_ENTRIES - 1)
+
+static bool isAlive(pid_t pid) {
+    return pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+int openFeed(Feed* feed, int recordFd, bool writer) {
+    struct stat status;
+    if (fstat(recordFd, &status) < 0)
+        return -1;
+    char name[64];
+    snprintf(name, sizeof(name), "/csieMask.%lx.%lx.feed",
+             (unsigned long)status.st_dev, (unsigned long)status.st_ino);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+    // a new segment is zero filled: no writer, nothing published
+    if (fstat(fd, &status) < 0 ||
+        ((size_t)status.st_size < sizeof(FeedRing) &&
+         ftruncate(fd, sizeof(FeedRing)) < 0)) {
+        close(fd);
+        return -1;
+    }
+    FeedRing* ring = (FeedRing*)mmap(NULL, sizeof(FeedRing),
+                                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping is all that is needed
+    if (ring == MAP_FAILED)
+        return -1;
+
+    static const char zeros[sizeof(ring->magic)];
+    // blank until a writer first opens it
+    if (memcmp(ring->magic, FEED_MAGIC, sizeof(ring->magic)) != 0 &&
+        memcmp(ring->magic, zeros, sizeof(zeros)) != 0) {
+        munmap(ring, sizeof(FeedRing));
+        errno = EINVAL;
+        return -1;
+    }
+    if (writer) {
+        int32_t pid = atomic_load(&ring->writer);
+        do {
+            if (isAlive(pid)) {
+                munmap(ring, sizeof(FeedRing));
+                errno = EBUSY;
+                return -1;
+            }
+        } while (!atomic_compare_exchange_weak(&ring->writer, &pid,
+                                               (int32_t)getpid()));
+        memcpy(ring->magic, FEED_MAGIC, sizeof(ring->magic));
+    }
+    feed->ring = ring;
+    feed->writer = writer;
+    feed->next = headOfFeed(feed);
+    if (writer)
+        // the locks of the last writer died with it
+        publishFeed(feed, FEED_RESET, 0, 0, 0, 0);
+    return 0;
+}
+
+void closeFeed(Feed* feed) {
+    if (feed->ring == NULL)
+        return;
+    if (feed->writer)
+        atomic_store(&feed->ring->writer, 0);
+    // the segment is left for the next writer, head goes on from there
+    munmap(feed->ring, sizeof(FeedRing));
+    memset(feed, 0, sizeof(Feed));
+}
+
+void publishFeed(Feed* feed, FeedKind kind, int idx, int id, int adultMask,
+                 int childrenMask) {
+    FeedRing* ring = feed->ring;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // only this process moves head
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->ring[head & FEED_MASK] = (FeedEntry){
+        .kind = kind,
+        .idx = idx,
+        .id = id,
+        .adultMask = adultMask,
+        .childrenMask = childrenMask,
+        .stamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int readFeed(Feed* feed, FeedEntry* entries, int max) {
+    FeedRing* ring = feed->ring;
+    uint64_t head = headOfFeed(feed);
+    // entry n is overwritten once the writer gets to entry n + FEED_ENTRIES,
+    // which it writes while head is still there
+    if (head - feed->next >= FEED_ENTRIES)
+        return -1;
+    int n = head - feed->next < (uint64_t)max ? (int)(head - feed->next) : max;
+    for (int i = 0; i < n; ++i)
+        entries[i] = ring->ring[(feed->next + i) & FEED_MASK];
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&ring->head, memory_order_relaxed) - feed->next >=
+        FEED_ENTRIES)
+        return -1;  // lapped while copying
+    feed->next += n;
+    return n;
+}
+
+bool writerOfFeedAlive(Feed* feed) {
+    return isAlive(atomic_load(&feed->ring->writer));
+}
@@ -0,0 +1,66 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Change stream from the write_server of a record file to read_server
+// replicas, in a POSIX shared memory segment named after the file like the
+// lock table. The writer appends to a ring of the last FEED_ENTRIES entries
+// and moves head past each one; replicas copy what is behind head into their
+// own records and check that head did not lap them meanwhile. A replica that
+// falls behind by a whole ring copies the record file again.
+#define FEED_MAGIC "csieFED1"
+#define FEED_ENTRIES 65536  // a power of 2
+
+typedef enum {
+    FEED_RECORD,  // the record after a committed write
+    FEED_LOCK,    // the writer holds the write lock of the record
+    FEED_UNLOCK,  // and released it
+    FEED_RESET,   // a new writer took over, no record is locked
+} FeedKind;
+
+typedef struct {
+    int32_t kind;  // FeedKind
+    int32_t idx;   // of the record in the file
+    int32_t id;    // FEED_RECORD only
+    int32_t adultMask;
+    int32_t childrenMask;
+    uint32_t reserved;
+    uint64_t stamp;  // CLOCK_MONOTONIC ns when published
+} FeedEntry;
+
+typedef struct {
+    char magic[8];
+    _Atomic int32_t writer;  // pid of the writer, 0 if none
+    uint32_t reserved;
+    _Atomic uint64_t head;  // entries published, entry n is in ring[n % size]
+    FeedEntry ring[FEED_ENTRIES];
+} FeedRing;
+
+typedef struct {
+    FeedRing* ring;  // NULL when closed
+    bool writer;
+    uint64_t next;  // replica: the next entry to apply
+} Feed;
+
+// Map the feed of recordFd, creating it if needed. The writer fails with
+// EBUSY while another live process writes the feed, and publishes FEED_RESET
+// when it takes over. A replica starts at head.
+int openFeed(Feed* feed, int recordFd, bool writer);
+void closeFeed(Feed* feed);
+void publishFeed(Feed* feed, FeedKind kind, int idx, int id, int adultMask,
+                 int childrenMask);
+// Copy up to max entries from feed->next on and move next past them.
+// Returns how many, or -1 if the writer overwrote entries that were not read
+// yet: start again at headOfFeed() from a fresh copy of the records.
+int readFeed(Feed* feed, FeedEntry* entries, int max);
+// false once the writer exited, its locks are gone
+bool writerOfFeedAlive(Feed* feed);
+
+static inline uint64_t headOfFeed(const Feed* feed) {
+    return atomic_load_explicit(&feed->ring->head, memory_order_acquire);
+}
+
+#endif
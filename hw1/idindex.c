@@ -0,0 +1,99 @@
+#include "idindex.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// use the dense table while at most half of it would be holes
+#define DENSE_FACTOR 2
+
+// slots for n ids at a load factor <= 0.5
+static void sizeHash(IdIndex* index, size_t n) {
+    index->cap = 1;
+    index->shift = 32;
+    while (index->cap < n * 2) {
+        index->cap <<= 1;
+        --index->shift;
+    }
+}
+
+// initIdIndex() but for the values, left for the caller to clear to -1;
+// hash: a hash table whatever the span
+static int allocIdIndex(IdIndex* index, int minId, int maxId, size_t n,
+                        bool hash) {
+    memset(index, 0, sizeof(IdIndex));
+    size_t span = n ? (size_t)((long)maxId - minId + 1) : 0;
+    index->dense = !hash && span <= n * DENSE_FACTOR;
+    if (index->dense) {
+        index->base = minId;
+        index->cap = span ? span : 1;
+    } else {
+        sizeHash(index, n);
+        index->keys = (int*)malloc(sizeof(int) * index->cap);
+        if (index->keys == NULL)
+            return -1;
+    }
+    index->values = (int*)malloc(sizeof(int) * index->cap);
+    if (index->values == NULL) {
+        free(index->keys);
+        index->keys = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int initIdIndex(IdIndex* index, int minId, int maxId, size_t n) {
+    if (allocIdIndex(index, minId, maxId, n, false) < 0)
+        return -1;
+    memset(index->values, 0xff, sizeof(int) * index->cap);  // all -1
+    return 0;
+}
+
+int insertIdIndex(IdIndex* index, int id, int idx) {
+    if (index->dense) {
+        size_t off = (size_t)((long)id - index->base);
+        if (off >= index->cap)
+            return -1;
+        if (index->values[off] < 0) {  // keep the first record, like a scan
+            index->values[off] = idx;
+            ++index->len;
+        }
+        return 0;
+    }
+    for (size_t i = hashId(index, id);; i = (i + 1) & (index->cap - 1)) {
+        if (index->values[i] < 0) {
+            index->keys[i] = id;
+            index->values[i] = idx;
+            ++index->len;
+            return 0;
+        }
+        if (index->keys[i] == id)
+            return 0;
+    }
+}
+
+bool hasRoomIdIndex(const IdIndex* index, int minId, int maxId, size_t n) {
+    if (index->len == 0)
+        return false;
+    if (index->dense)
+        return minId >= index->base &&
+               (long)maxId < (long)index->base + (long)index->cap;
+    return index->cap >= n * 2;
+}
+
+int initGrownIdIndex(IdIndex* grown, const IdIndex* index, int minId,
+                     int maxId, size_t n) {
+    if (index->len == 0)
+        return allocIdIndex(grown, minId, maxId, n, false);
+    if (!index->dense)
+        return allocIdIndex(grown, minId, maxId, n, true);  // stays a hash
+    // dense again while the holes allow
+    long last = (long)index->base + index->cap - 1;
+    return allocIdIndex(grown, minId < index->base ? minId : index->base,
+                        maxId > last ? maxId : (int)last, n, false);
+}
+
+void freeIdIndex(IdIndex* index) {
+    free(index->keys);
+    free(index->values);
+    memset(index, 0, sizeof(IdIndex));
+}
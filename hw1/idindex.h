@@ -0,0 +1,52 @@
+#ifndef IDINDEX_H
+#define IDINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Map customer id -> index in idInfo.
+// Contiguous ids get a direct-mapped table indexed by (id - base), anything
+// else falls back to an open-addressing (linear probing) hash table.
+typedef struct {
+    bool dense;
+    int base;      // dense: smallest id
+    size_t cap;    // dense: span of ids, hash: number of slots (power of 2)
+    int shift;     // hash: 32 - log2(cap)
+    int* keys;     // hash only
+    int* values;   // index into idInfo, -1 for an empty slot
+    size_t len;    // ids in the index
+} IdIndex;
+
+int initIdIndex(IdIndex* index, int minId, int maxId, size_t n);
+// whether index holds n ids in all, minId..maxId among them, as it is
+bool hasRoomIdIndex(const IdIndex* index, int minId, int maxId, size_t n);
+// An index for n ids in all, minId..maxId and those of index among them:
+// index widened, or turned into a hash table once too many holes would be
+// left. Its cap values are not cleared to -1 yet, so that the caller can
+// spread that out; the entries are for the caller to move over as well.
+int initGrownIdIndex(IdIndex* grown, const IdIndex* index, int minId,
+                     int maxId, size_t n);
+int insertIdIndex(IdIndex* index, int id, int idx);
+void freeIdIndex(IdIndex* index);
+
+static inline size_t hashId(const IdIndex* index, int id) {
+    // Fibonacci hashing: the high bits of the product, the low ones depend
+    // only on the low bits of id
+    return (uint64_t)((uint32_t)id * 2654435769u) >> index->shift;
+}
+
+static inline int lookUpIdIndex(const IdIndex* index, int id) {
+    if (index->dense) {
+        size_t off = (size_t)((long)id - index->base);
+        return off < index->cap ? index->values[off] : -1;
+    }
+    for (size_t i = hashId(index, id);; i = (i + 1) & (index->cap - 1)) {
+        if (index->values[i] < 0)
+            return -1;
+        if (index->keys[i] == id)
+            return index->values[i];
+    }
+}
+
+#endif
@@ -0,0 +1,178 @@
+// Measure lookup latency of a csieMask server while it holds many idle
+// connections, e.g.
+//   ./idlebench -c 10000 -n 2000 localhost 3333
+// Connections are spread over 127.0.0.{1..k} source addresses (-k) so that
+// more than one ephemeral port range worth of sockets can be opened.
+// With -p every sample is sent over one connection to a server running with
+// -k, instead of a new connection per sample.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+static struct sockaddr_in svrAddr;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connectFrom(int srcIdx) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        ERR_EXIT("socket");
+    if (srcIdx > 0) {
+        struct sockaddr_in src = {.sin_family = AF_INET, .sin_port = 0};
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + srcIdx);
+        if (bind(fd, (struct sockaddr*)&src, sizeof(src)) < 0)
+            ERR_EXIT("bind");
+    }
+    if (connect(fd, (struct sockaddr*)&svrAddr, sizeof(svrAddr)) < 0)
+        ERR_EXIT("connect");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// read until n lines are received or the server closes the connection
+static int readLines(int fd, int n) {
+    char buf[512];
+    while (n > 0) {
+        int ret = read(fd, buf, sizeof(buf));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        for (int i = 0; i < ret; ++i)
+            n -= buf[i] == '\n';
+    }
+    return 0;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int nIdle = 100, nSample = 1000, nSrc = 1, id = 902001, opt;
+    int persistent = 0;
+    while ((opt = getopt(argc, argv, "c:n:k:i:p")) != -1) {
+        switch (opt) {
+        case 'c':
+            nIdle = atoi(optarg);
+            break;
+        case 'n':
+            nSample = atoi(optarg);
+            break;
+        case 'k':
+            nSrc = atoi(optarg);
+            break;
+        case 'i':
+            id = atoi(optarg);
+            break;
+        case 'p':
+            persistent = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2 || nSample <= 0 || nSrc <= 0) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-c idle] [-n samples] [-k sources] [-i id] [-p] "
+                "host port\n",
+                argv[0]);
+        exit(1);
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (host == NULL) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        exit(1);
+    }
+    svrAddr.sin_family = AF_INET;
+    svrAddr.sin_port = htons(atoi(argv[optind + 1]));
+    memcpy(&svrAddr.sin_addr, host->h_addr_list[0], host->h_length);
+
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    // open idle connections, wait for the prompt so the server has accepted
+    int* idle = (int*)malloc(sizeof(int) * (nIdle > 0 ? nIdle : 1));
+    for (int i = 0; i < nIdle; ++i) {
+        idle[i] = connectFrom(nSrc > 1 ? i % nSrc : 0);
+        if (readLines(idle[i], 1) < 0) {
+            fprintf(stderr, "idle connection %d closed by server\n", i);
+            exit(1);
+        }
+    }
+
+    char query[32];
+    int queryLen = sprintf(query, "%d\n", id);
+    double* lat = (double*)malloc(sizeof(double) * nSample);
+    if (persistent) {
+        int fd = connectFrom(0);
+        if (readLines(fd, 1) < 0) {
+            fprintf(stderr, "connection closed by server\n");
+            exit(1);
+        }
+        for (int i = 0; i < nSample; ++i) {
+            // reply and the next prompt
+            double start = now();
+            if (write(fd, query, queryLen) != queryLen ||
+                readLines(fd, 2) < 0) {
+                fprintf(stderr,
+                        "sample %d failed, is the server run with -k?\n", i);
+                exit(1);
+            }
+            lat[i] = now() - start;
+        }
+        close(fd);
+    } else {
+        for (int i = 0; i < nSample; ++i) {
+            double start = now();
+            int fd = connectFrom(0);
+            if (readLines(fd, 1) < 0 ||
+                write(fd, query, queryLen) != queryLen ||
+                readLines(fd, 1) < 0) {
+                fprintf(stderr, "sample %d failed\n", i);
+                exit(1);
+            }
+            lat[i] = now() - start;
+            close(fd);
+        }
+    }
+    qsort(lat, nSample, sizeof(double), cmpDouble);
+
+    printf("%sidle=%d samples=%d p50=%.1fus p99=%.1fus p999=%.1fus "
+           "max=%.1fus\n",
+           persistent ? "keep-alive " : "", nIdle, nSample,
+           lat[nSample / 2] * 1e6, lat[nSample * 99 / 100] * 1e6,
+           lat[nSample * 999 / 1000] * 1e6, lat[nSample - 1] * 1e6);
+
+    for (int i = 0; i < nIdle; ++i)
+        close(idle[i]);
+    free(idle);
+    free(lat);
+    return 0;
+}
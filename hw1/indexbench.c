@@ -0,0 +1,118 @@
+// Compare id lookups through IdIndex against the old linear scan of idInfo.
+//   ./indexbench [n ...]     (default: 20 10000 10000000)
+// Every size is measured with contiguous ids (dense table), with sparse
+// random ids and with ids 65536 apart (hash table): the last ones agree in
+// their low bits, a hash that keeps those piles them into one run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "idindex.h"
+
+#define N_LOOKUP 1000000
+#define SCAN_BUDGET 2e9  // id comparisons spent on the linear scan
+
+typedef enum { CONTIGUOUS, RANDOM, STRIDED } IdSet;
+static const char* const idSetNames[] = {"contig", "random", "stride"};
+
+typedef struct {
+    int id;
+    int adultMask;
+    int childrenMask;
+} Order;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the getIndexOfId() this replaces
+static int scanIndexOfId(const Order* idInfo, int idInfoLen, int id) {
+    for (int i = 0; i < idInfoLen; ++i) {
+        if (abs(idInfo[i].id) == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// the i-th id of set, all of them distinct
+static int makeId(IdSet set, int i) {
+    switch (set) {
+    case CONTIGUOUS:
+        return 902001 + i;
+    case RANDOM:
+        return (int)(random() & 0x3fffffff);
+    default:
+        // i << 16, the bits shifted out come back at the bottom
+        return (int)(((unsigned)i << 16 | (unsigned)i >> 15) & 0x7fffffff);
+    }
+}
+
+static void bench(int n, IdSet set) {
+    Order* idInfo = (Order*)malloc(sizeof(Order) * n);
+    int* queries = (int*)malloc(sizeof(int) * N_LOOKUP);
+    int minId = 902001, maxId = 902001;
+    for (int i = 0; i < n; ++i) {
+        idInfo[i].id = makeId(set, i);
+        idInfo[i].adultMask = idInfo[i].childrenMask = 10;
+        minId = i == 0 || idInfo[i].id < minId ? idInfo[i].id : minId;
+        maxId = i == 0 || idInfo[i].id > maxId ? idInfo[i].id : maxId;
+    }
+    for (int i = 0; i < N_LOOKUP; ++i)
+        queries[i] = idInfo[random() % n].id;
+
+    double start = now();
+    IdIndex index;
+    if (initIdIndex(&index, minId, maxId, n) < 0) {
+        perror("initIdIndex");
+        exit(1);
+    }
+    for (int i = 0; i < n; ++i)
+        insertIdIndex(&index, idInfo[i].id, i);
+    double build = now() - start;
+
+    long sum = 0;
+    start = now();
+    for (int i = 0; i < N_LOOKUP; ++i)
+        sum += lookUpIdIndex(&index, queries[i]);
+    double indexed = (now() - start) / N_LOOKUP;
+
+    int nScan = SCAN_BUDGET / n;
+    nScan = nScan > N_LOOKUP ? N_LOOKUP : nScan < 1 ? 1 : nScan;
+    start = now();
+    for (int i = 0; i < nScan; ++i)
+        sum -= scanIndexOfId(idInfo, n, queries[i]);
+    double scan = (now() - start) / nScan;
+
+    // both must agree on every scanned query, leaving sum == 0
+    for (int i = nScan; i < N_LOOKUP; ++i)
+        sum -= lookUpIdIndex(&index, queries[i]);
+
+    printf("n=%-9d %-6s %-6s build=%8.2fms index=%7.1fns scan=%12.1fns "
+           "(%d scans)%s\n",
+           n, idSetNames[set], index.dense ? "dense" : "hash", build * 1e3,
+           indexed * 1e9,
+           scan * 1e9, nScan, sum ? " checksum mismatch" : "");
+    freeIdIndex(&index);
+    free(idInfo);
+    free(queries);
+}
+
+int main(int argc, char* argv[]) {
+    static int defaults[] = {20, 10000, 10000000};
+    int nSize = argc > 1 ? argc - 1 : 3;
+    for (int i = 0; i < nSize; ++i) {
+        int n = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [n ...]\n", argv[0]);
+            return 1;
+        }
+        bench(n, CONTIGUOUS);
+        bench(n, RANDOM);
+        bench(n, STRIDED);
+    }
+    return 0;
+}
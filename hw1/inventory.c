@@ -0,0 +1,107 @@
+#include "inventory.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES 4   // int32_t in a vector
+#define BLOCK 16  // values scanned per iteration, 4 vectors
+
+typedef int32_t Lanes __attribute__((vector_size(LANES * 4)));
+typedef int64_t WideLanes __attribute__((vector_size(LANES * 8)));
+typedef int64_t Pairs __attribute__((vector_size(LANES * 4)));
+
+int initInventory(Inventory* inv, int nSkus, const char* const* names,
+                  int cap) {
+    memset(inv, 0, sizeof(Inventory));
+    if (nSkus < 1 || nSkus > INV_MAX_SKUS)
+        return -1;
+    inv->nSkus = nSkus;
+    for (int s = 0; s < nSkus; ++s)
+        inv->names[s] = names[s];
+    if (reserveInventory(inv, cap) < 0) {
+        freeInventory(inv);
+        return -1;
+    }
+    return 0;
+}
+
+int reserveInventory(Inventory* inv, int cap) {
+    if (cap <= inv->cap)
+        return 0;
+    int32_t* ids = (int32_t*)realloc(inv->ids, sizeof(int32_t) * cap);
+    if (ids == NULL)
+        return -1;
+    inv->ids = ids;
+    for (int s = 0; s < inv->nSkus; ++s) {
+        int32_t* stock =
+            (int32_t*)realloc(inv->stock[s], sizeof(int32_t) * cap);
+        if (stock == NULL)
+            return -1;  // the columns grown so far are kept, cap is not
+        inv->stock[s] = stock;
+    }
+    inv->cap = cap;
+    return 0;
+}
+
+void freeInventory(Inventory* inv) {
+    free(inv->ids);
+    for (int s = 0; s < inv->nSkus; ++s)
+        free(inv->stock[s]);
+    memset(inv, 0, sizeof(Inventory));
+}
+
+int skuOfInventory(const Inventory* inv, const char* name) {
+    for (int s = 0; s < inv->nSkus; ++s)
+        if (strcmp(inv->names[s], name) == 0)
+            return s;
+    return -1;
+}
+
+int64_t sumInventory(const Inventory* inv, int sku) {
+    const int32_t* stock = inv->stock[sku];
+    WideLanes sums = {0};  // 32 bits would overflow
+    int i = 0;
+    for (; i + BLOCK <= inv->len; i += BLOCK) {
+        Lanes lanes[BLOCK / LANES];
+        memcpy(lanes, &stock[i], sizeof(lanes));  // the columns are unaligned
+        for (int v = 0; v < BLOCK / LANES; ++v)
+            sums += __builtin_convertvector(lanes[v], WideLanes);
+    }
+    int64_t sum = 0;
+    for (int k = 0; k < LANES; ++k)
+        sum += sums[k];
+    for (; i < inv->len; ++i)
+        sum += stock[i];
+    return sum;
+}
+
+int belowInventory(const Inventory* inv, int sku, int32_t threshold, int* out,
+                   int max) {
+    const int32_t* stock = inv->stock[sku];
+    Lanes bound = threshold - (Lanes){0};  // threshold in every lane
+    int n = 0, i = 0;
+    for (; i + BLOCK <= inv->len; i += BLOCK) {
+        Lanes lanes[BLOCK / LANES];
+        memcpy(lanes, &stock[i], sizeof(lanes));
+        Lanes below = lanes[0] < bound;  // -1 where true
+        for (int v = 1; v < BLOCK / LANES; ++v)
+            below |= lanes[v] < bound;
+        // most blocks hold no match and are skipped whole
+        Pairs pairs = (Pairs)below;
+        if ((pairs[0] | pairs[1]) == 0)
+            continue;
+        for (int k = i; k < i + BLOCK; ++k)
+            if (stock[k] < threshold) {
+                if (n < max)
+                    out[n] = k;
+                ++n;
+            }
+    }
+    for (; i < inv->len; ++i)
+        if (stock[i] < threshold) {
+            if (n < max)
+                out[n] = i;
+            ++n;
+        }
+    return n;
+}
@@ -0,0 +1,36 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Stock of every record by SKU, one column per SKU: record i has id ids[i]
+// and stock[s][i] of SKU s. A report on one SKU scans one contiguous array
+// in 128 bit vectors, which every target has, instead of striding over
+// whole records.
+#define INV_MAX_SKUS 16
+
+typedef struct {
+    int nSkus;
+    const char* names[INV_MAX_SKUS];
+    int len;  // records in the columns
+    int cap;
+    int32_t* ids;
+    int32_t* stock[INV_MAX_SKUS];
+} Inventory;
+
+int initInventory(Inventory* inv, int nSkus, const char* const* names,
+                  int cap);
+// make room for cap records, keeping the columns
+int reserveInventory(Inventory* inv, int cap);
+void freeInventory(Inventory* inv);
+// SKU called name, -1 if there is none
+int skuOfInventory(const Inventory* inv, const char* name);
+// total stock of sku over all records
+int64_t sumInventory(const Inventory* inv, int sku);
+// records with less than threshold of sku: the first max of them go to out,
+// returns how many there are in all
+int belowInventory(const Inventory* inv, int sku, int32_t threshold, int* out,
+                   int max);
+
+#endif
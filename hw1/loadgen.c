@@ -0,0 +1,451 @@
+// Closed-loop load generator for read_server and write_server, e.g.
+//   ./loadgen -c 2000 -k 4 -w 10 -z 1.1 -d 10 localhost 3333 3334
+// Every connection runs one operation after another: a read sends an id to
+// the read server, a write sends an id and then "adult 1" to the write
+// server. Operations open a connection each, the way the servers close after
+// a request by default, or with -p reuse it against servers run with -k; a
+// connection then sticks to one server, and -w picks the share of write
+// connections instead of write operations.
+// Ids are drawn uniformly from -n ids starting at -i, or Zipf distributed
+// with -z s, the first id being the hottest. Once an id has ordered all of
+// its masks its writes fail, restore preorderRecord between runs.
+// With -s the ids are split into that many shards as shard.h does, shard k
+// being served on read-port + k and write-port + k; an operation goes to the
+// servers of its id, and a -p connection only draws ids of its shard.
+// The report is one line of key=value pairs, JSON with -J. Latencies are in
+// microseconds, from connect (or from sending the id with -p) to the reply.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shard.h"
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+// Latency histogram in the manner of HdrHistogram: values below 2^SUB_BITS
+// are counted exactly, above that every power of two is split into 2^(SUB_
+// BITS-1) buckets, a relative error of at most 2^(1-SUB_BITS).
+#define HIST_SUB_BITS 8
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int histIndex(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS))
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1;
+    return (shift + 1) * HIST_HALF + (int)(v >> shift) - HIST_HALF;
+}
+
+// largest value counted in bucket idx
+static uint64_t histValue(int idx) {
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int shift = idx / HIST_HALF - 1;
+    uint64_t sub = idx % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void histRecord(Histogram* hist, uint64_t v) {
+    ++hist->counts[histIndex(v)];
+    ++hist->total;
+    hist->max = v > hist->max ? v : hist->max;
+}
+
+static uint64_t histPercentile(const Histogram* hist, double pct) {
+    if (hist->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(pct / 100 * hist->total), seen = 0;
+    rank = rank < 1 ? 1 : rank;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t v = histValue(i);
+            return v < hist->max ? v : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+typedef enum { CONNECTING, ID_SENT, ORDER_SENT, DONE } Phase;
+typedef enum { OK, LOCKED, FAILED, ERROR } Outcome;
+
+typedef struct {
+    int fd;
+    int src;     // index of the source address
+    int shard;   // of the ids it sends
+    int gen;     // bumped by every reconnect
+    bool write;  // the operation orders a mask
+    Phase phase;
+    uint64_t start;  // ns, when the operation started
+    size_t len;
+    char buf[512];
+} Conn;
+
+static struct sockaddr_in readAddr, writeAddr;
+static int firstId = 902001, nIds = 20, writePct = 0, nSrc = 1, nShards = 1;
+static double zipfS = 0;
+static double* zipfCdf = NULL;
+static bool persistent = false, json = false;
+static uint64_t rng = 88172645463325252ull;
+
+static int epollFd;
+static Histogram latency;
+static long outcomes[4], reads, writes;
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t nextRandom() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ull;
+}
+
+static double uniform() {
+    return (nextRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void initZipf() {
+    zipfCdf = (double*)malloc(sizeof(double) * nIds);
+    if (zipfCdf == NULL)
+        ERR_EXIT("malloc");
+    double sum = 0;
+    for (int i = 0; i < nIds; ++i)
+        zipfCdf[i] = sum += pow(i + 1, -zipfS);
+    for (int i = 0; i < nIds; ++i)
+        zipfCdf[i] /= sum;
+}
+
+static int pickId() {
+    if (zipfCdf == NULL)
+        return firstId + (int)(nextRandom() % nIds);
+    double u = uniform();
+    int lo = 0, hi = nIds - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipfCdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return firstId + lo;
+}
+
+// an id of shard, drawn like pickId()
+static int pickIdOf(int shard) {
+    int id;
+    do {
+        id = pickId();
+    } while (nShards > 1 && shardOfId(id, firstId, nIds, nShards) != shard);
+    return id;
+}
+
+static void openConn(Conn* conn) {
+    if (!persistent)
+        conn->write = writePct > 0 && (int)(nextRandom() % 100) < writePct;
+    if (!persistent && nShards > 1)
+        conn->shard = shardOfId(pickId(), firstId, nIds, nShards);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        ERR_EXIT("socket");
+    if (conn->src > 0) {
+        struct sockaddr_in src = {.sin_family = AF_INET, .sin_port = 0};
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + conn->src);
+        if (bind(fd, (struct sockaddr*)&src, sizeof(src)) < 0)
+            ERR_EXIT("bind");
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr = conn->write ? writeAddr : readAddr;
+    addr.sin_port = htons(ntohs(addr.sin_port) + conn->shard);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 &&
+        errno != EINPROGRESS)
+        ERR_EXIT("connect");
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        ERR_EXIT("epoll_ctl");
+    conn->fd = fd;
+    ++conn->gen;
+    conn->len = 0;
+    conn->phase = CONNECTING;
+    conn->start = nowNs();
+}
+
+static void closeConn(Conn* conn) {
+    close(conn->fd);  // drops it from epollFd as well
+    conn->fd = -1;
+}
+
+static int sendStr(Conn* conn, const char* str) {
+    size_t len = strlen(str);
+    return write(conn->fd, str, len) == (ssize_t)len ? 0 : -1;
+}
+
+// the operation of conn is over, counted if it ended before the deadline
+static void finish(Conn* conn, Outcome res, bool counted) {
+    if (counted) {
+        ++outcomes[res];
+        if (res != ERROR) {
+            histRecord(&latency, (nowNs() - conn->start + 500) / 1000);
+            ++*(conn->write ? &writes : &reads);
+        }
+    }
+    conn->phase = DONE;
+    if (!persistent || res == ERROR) {
+        closeConn(conn);
+        openConn(conn);
+    }
+}
+
+// act on one line from the server
+static void handleLine(Conn* conn, const char* line, bool counted) {
+    if (strncmp(line, "Please enter the id", 19) == 0) {
+        if (conn->phase != CONNECTING && conn->phase != DONE)
+            return;
+        if (conn->phase == DONE)
+            conn->start = nowNs();
+        char id[32];
+        sprintf(id, "%d\n", pickIdOf(conn->shard));
+        if (sendStr(conn, id) < 0) {
+            finish(conn, ERROR, counted);
+            return;
+        }
+        conn->phase = ID_SENT;
+    } else if (strncmp(line, "You can order", 13) == 0) {
+        if (!conn->write)
+            finish(conn, OK, counted);
+    } else if (strncmp(line, "Please enter the mask type", 26) == 0) {
+        if (sendStr(conn, "adult 1\n") < 0) {
+            finish(conn, ERROR, counted);
+            return;
+        }
+        conn->phase = ORDER_SENT;
+    } else if (strncmp(line, "Pre-order for", 13) == 0) {
+        finish(conn, OK, counted);
+    } else if (strcmp(line, "Locked.") == 0) {
+        finish(conn, LOCKED, counted);
+    } else if (strcmp(line, "Operation failed.") == 0) {
+        finish(conn, FAILED, counted);
+    }
+}
+
+static void serveConn(Conn* conn, bool counted) {
+    while (1) {
+        ssize_t n = read(conn->fd, conn->buf + conn->len,
+                         sizeof(conn->buf) - 1 - conn->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n <= 0) {
+            // closed between operations is fine without -p
+            finish(conn, ERROR, counted && conn->phase != DONE);
+            return;
+        }
+        conn->len += n;
+        char* line = conn->buf;
+        char* eol;
+        int gen = conn->gen;
+        while ((eol = memchr(line, '\n', conn->buf + conn->len - line))) {
+            *eol = '\0';
+            handleLine(conn, line, counted);
+            if (conn->gen != gen)
+                return;  // replaced by a new connection
+            line = eol + 1;
+        }
+        conn->len -= line - conn->buf;
+        memmove(conn->buf, line, conn->len);
+        if (conn->len == sizeof(conn->buf) - 1)
+            conn->len = 0;  // not a line of ours, drop it
+    }
+}
+
+static bool first = true;
+
+static void emitInt(const char* key, long value) {
+    printf(json ? "%s\"%s\":%ld" : "%s%s=%ld", first ? "" : json ? "," : " ",
+           key, value);
+    first = false;
+}
+
+static void emitFloat(const char* key, double value) {
+    printf(json ? "%s\"%s\":%.3f" : "%s%s=%.3f", first ? "" : json ? "," : " ",
+           key, value);
+    first = false;
+}
+
+static int resolve(const char* name, const char* port,
+                   struct sockaddr_in* addr) {
+    struct hostent* host = gethostbyname(name);
+    if (host == NULL)
+        return -1;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(port));
+    memcpy(&addr->sin_addr, host->h_addr_list[0], host->h_length);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int nConn = 100, opt;
+    double duration = 10;
+    while ((opt = getopt(argc, argv, "c:d:i:k:n:pS:s:w:z:J")) != -1) {
+        switch (opt) {
+        case 'c':
+            nConn = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'i':
+            firstId = atoi(optarg);
+            break;
+        case 'k':
+            nSrc = atoi(optarg);
+            break;
+        case 'n':
+            nIds = atoi(optarg);
+            break;
+        case 'p':
+            persistent = true;
+            break;
+        case 'S':
+            rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 's':
+            nShards = atoi(optarg);
+            break;
+        case 'w':
+            writePct = atoi(optarg);
+            break;
+        case 'z':
+            zipfS = atof(optarg);
+            break;
+        case 'J':
+            json = true;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    int nArgs = argc - optind;
+    if (nArgs < 2 || nArgs > 3 || nConn <= 0 || duration <= 0 || nIds <= 0 ||
+        nSrc <= 0 || nShards <= 0 || nShards > nIds || writePct < 0 ||
+        writePct > 100 || zipfS < 0 || (writePct > 0 && nArgs < 3)) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-c conns] [-d seconds] [-i first id] [-n ids] "
+                "[-k sources] [-p] [-S seed] [-s shards] [-w write%%] "
+                "[-z zipf s] [-J] "
+                "host read-port [write-port]\n",
+                argv[0]);
+        exit(1);
+    }
+    if (resolve(argv[optind], argv[optind + 1], &readAddr) < 0 ||
+        (nArgs == 3 &&
+         resolve(argv[optind], argv[optind + 2], &writeAddr) < 0)) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        exit(1);
+    }
+    if (zipfS > 0)
+        initZipf();
+
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    epollFd = epoll_create1(0);
+    if (epollFd < 0)
+        ERR_EXIT("epoll_create1");
+    Conn* conns = (Conn*)calloc(nConn, sizeof(Conn));
+    struct epoll_event* events =
+        (struct epoll_event*)malloc(sizeof(struct epoll_event) * 1024);
+    if (!conns || !events)
+        ERR_EXIT("malloc");
+    for (int i = 0; i < nConn; ++i) {
+        conns[i].src = nSrc > 1 ? i % nSrc : 0;
+        conns[i].shard = i % nShards;
+        conns[i].write = persistent && (long)i * 100 < (long)nConn * writePct;
+        openConn(&conns[i]);
+    }
+
+    uint64_t start = nowNs(), end = start + (uint64_t)(duration * 1e9);
+    while (1) {
+        uint64_t now = nowNs();
+        if (now >= end)
+            break;
+        int n = epoll_wait(epollFd, events, 1024,
+                           (int)((end - now + 999999) / 1000000));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            ERR_EXIT("epoll_wait");
+        bool counted = nowNs() < end;
+        for (int j = 0; j < n; ++j)
+            serveConn((Conn*)events[j].data.ptr, counted);
+    }
+    double secs = (nowNs() - start) * 1e-9;
+
+    long ops = outcomes[OK] + outcomes[LOCKED] + outcomes[FAILED];
+    printf(json ? "{" : "");
+    emitInt("conns", nConn);
+    emitInt("write_pct", writePct);
+    emitFloat("zipf", zipfS);
+    emitInt("persistent", persistent);
+    emitInt("shards", nShards);
+    emitFloat("seconds", secs);
+    emitInt("ops", ops);
+    emitFloat("ops_per_s", ops / secs);
+    emitInt("reads", reads);
+    emitInt("writes", writes);
+    emitInt("ok", outcomes[OK]);
+    emitInt("locked", outcomes[LOCKED]);
+    emitFloat("locked_rate", ops ? (double)outcomes[LOCKED] / ops : 0);
+    emitInt("failed", outcomes[FAILED]);
+    emitInt("errors", outcomes[ERROR]);
+    static const double pcts[] = {50, 90, 99, 99.9, 99.99};
+    static const char* names[] = {"p50_us", "p90_us", "p99_us", "p999_us",
+                                  "p9999_us"};
+    for (int i = 0; i < 5; ++i)
+        emitInt(names[i], (long)histPercentile(&latency, pcts[i]));
+    emitInt("max_us", (long)latency.max);
+    printf(json ? "}\n" : "\n");
+
+    for (int i = 0; i < nConn; ++i)
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    close(epollFd);
+    free(conns);
+    free(events);
+    free(zipfCdf);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE  // mremap()
+
+#include "locktable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WRITER(word) ((pid_t)((word) >> 32))
+#define READERS(word) ((uint32_t)(word))
+#define WRITER_WORD(pid) ((uint64_t)(uint32_t)(pid) << 32)
+
+int attachLockTable(LockTable* table, int recordFd, size_t len) {
+    // one segment per record file: named after its device and inode
+    struct stat status;
+    if (fstat(recordFd, &status) < 0)
+        return -1;
+    char name[64];
+    snprintf(name, sizeof(name), "/csieMask.%lx.%lx",
+             (unsigned long)status.st_dev, (unsigned long)status.st_ino);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return -1;
+
+    // a new segment is zero filled: no writer, no readers
+    size_t size = (len ? len : 1) * sizeof(LockSlot);
+    if (fstat(fd, &status) < 0 ||
+        ((size_t)status.st_size < size && ftruncate(fd, size) < 0)) {
+        close(fd);
+        return -1;
+    }
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    table->slots = (LockSlot*)addr;
+    table->len = len;
+    table->fd = fd;
+    table->pid = getpid();
+    return 0;
+}
+
+void detachLockTable(LockTable* table) {
+    if (table->slots == NULL)
+        return;
+    // the segment is left for the other servers
+    munmap(table->slots, (table->len ? table->len : 1) * sizeof(LockSlot));
+    close(table->fd);
+    memset(table, 0, sizeof(LockTable));
+}
+
+int growLockTable(LockTable* table, size_t len) {
+    if (len <= table->len)
+        return 0;
+    size_t oldSize = (table->len ? table->len : 1) * sizeof(LockSlot);
+    size_t size = len * sizeof(LockSlot);
+    // unlike ftruncate(), racing with a smaller grow cannot shrink it
+    int err = posix_fallocate(table->fd, 0, size);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    void* addr = mremap(table->slots, oldSize, size, MREMAP_MAYMOVE);
+    if (addr == MAP_FAILED)
+        return -1;
+    table->slots = (LockSlot*)addr;
+    table->len = len;
+    return 0;
+}
+
+// Clear a write lock whose owner no longer exists, returns true if the lock
+// word changed and the caller should try again.
+static bool reapWriter(LockTable* table, size_t idx, uint64_t seen) {
+    LockSlot* slot = &table->slots[idx];
+    pid_t pid = WRITER(seen);
+    if (pid == 0 || pid == table->pid || kill(pid, 0) == 0 || errno != ESRCH)
+        return false;
+    if (!atomic_compare_exchange_strong(&slot->word, &seen, READERS(seen)))
+        return true;
+    // it may have died halfway through an update
+    uint64_t seq = atomic_load(&slot->seq);
+    if (seq & 1)
+        atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1);
+    return true;
+}
+
+int tryReadLockTable(LockTable* table, size_t idx) {
+    _Atomic uint64_t* word = &table->slots[idx].word;
+    uint64_t seen = atomic_load_explicit(word, memory_order_relaxed);
+    do {
+        if (WRITER(seen) != 0) {
+            if (reapWriter(table, idx, seen)) {
+                seen = atomic_load_explicit(word, memory_order_relaxed);
+                continue;
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        word, &seen, seen + 1, memory_order_acquire, memory_order_relaxed));
+    return 0;
+}
+
+int tryWriteLockTable(LockTable* table, size_t idx, bool upgrade) {
+    // upgrade: the caller holds one of the read locks, like fcntl() does
+    _Atomic uint64_t* word = &table->slots[idx].word;
+    uint64_t expected = upgrade ? 1 : 0;
+    while (!atomic_compare_exchange_strong_explicit(
+        word, &expected, WRITER_WORD(table->pid), memory_order_acquire,
+        memory_order_relaxed)) {
+        if (!reapWriter(table, idx, expected)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        expected = upgrade ? 1 : 0;
+    }
+    return 0;
+}
+
+int unlockTable(LockTable* table, size_t idx, bool write) {
+    _Atomic uint64_t* word = &table->slots[idx].word;
+    if (write) {
+        uint64_t expected = WRITER_WORD(table->pid);
+        if (!atomic_compare_exchange_strong_explicit(
+                word, &expected, 0, memory_order_release,
+                memory_order_relaxed)) {
+            errno = EPERM;  // taken over, we were presumed dead
+            return -1;
+        }
+        return 0;
+    }
+    atomic_fetch_sub_explicit(word, 1, memory_order_release);
+    return 0;
+}
+
+void beginUpdateLockTable(LockTable* table, size_t idx) {
+    LockSlot* slot = &table->slots[idx];
+    atomic_fetch_add_explicit(&slot->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void endUpdateLockTable(LockTable* table, size_t idx) {
+    atomic_fetch_add_explicit(&table->slots[idx].seq, 1,
+                              memory_order_release);
+}
+
+int beginSnapshotLockTable(LockTable* table, size_t idx, uint64_t* seq) {
+    LockSlot* slot = &table->slots[idx];
+    do {
+        *seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        uint64_t word = atomic_load_explicit(&slot->word, memory_order_acquire);
+        // an odd sequence means a writer is updating, it holds the lock too
+        if (WRITER(word) == 0 && !(*seq & 1))
+            return 0;
+    } while (reapWriter(table, idx,
+                        atomic_load_explicit(&slot->word,
+                                             memory_order_relaxed)));
+    errno = EAGAIN;
+    return -1;
+}
+
+bool endSnapshotLockTable(LockTable* table, size_t idx, uint64_t seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&table->slots[idx].seq,
+                                memory_order_relaxed) == seq;
+}
@@ -0,0 +1,51 @@
+#ifndef LOCKTABLE_H
+#define LOCKTABLE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Per-record reader/writer locks in a POSIX shared memory segment, shared by
+// every server that opens the same record file.
+// Each record has one word: the pid of the writer in the upper 32 bits (0 if
+// none) and the number of readers in the lower 32 bits. A write lock left by
+// a dead process is taken over by the next process that runs into it.
+// Read locks are only held while a record is copied, they are not recovered.
+// Next to it is a sequence number, odd while the write lock holder is
+// updating the record, which lets readers copy a record without locking.
+typedef struct {
+    _Atomic uint64_t word;
+    _Atomic uint64_t seq;
+} LockSlot;
+
+typedef struct {
+    LockSlot* slots;
+    size_t len;  // number of records covered
+    int fd;
+    pid_t pid;  // getpid() of the attached process, saves a syscall
+} LockTable;
+
+int attachLockTable(LockTable* table, int recordFd, size_t len);
+void detachLockTable(LockTable* table);
+// Cover len records, the record file has grown. The segment only ever grows
+// and new slots are free; every server grows its own view when it runs into
+// the new records.
+int growLockTable(LockTable* table, size_t len);
+int tryReadLockTable(LockTable* table, size_t idx);
+int tryWriteLockTable(LockTable* table, size_t idx, bool upgrade);
+int unlockTable(LockTable* table, size_t idx, bool write);
+
+// Seqlock: a writer brackets its update of the record with
+// beginUpdateLockTable/endUpdateLockTable while holding the write lock.
+// A reader calls beginSnapshotLockTable, copies the record and keeps the
+// copy if endSnapshotLockTable returns true, otherwise it starts over.
+// beginSnapshotLockTable fails like tryReadLockTable while a writer holds
+// the record.
+void beginUpdateLockTable(LockTable* table, size_t idx);
+void endUpdateLockTable(LockTable* table, size_t idx);
+int beginSnapshotLockTable(LockTable* table, size_t idx, uint64_t* seq);
+bool endSnapshotLockTable(LockTable* table, size_t idx, uint64_t seq);
+
+#endif
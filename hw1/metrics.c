@@ -0,0 +1,40 @@
+#include "metrics.h"
+
+#include <stdio.h>
+
+uint64_t histogramValue(int idx) {
+    if (idx < (1 << HIST_SUB_BITS))
+        return idx;
+    int shift = idx / HIST_HALF - 1;
+    uint64_t sub = idx % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t percentileHistogram(const Histogram* hist, double pct) {
+    if (hist->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct / 100 * hist->count + 0.5), seen = 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = histogramValue(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+int formatHistogram(char* buf, size_t size, const Histogram* hist) {
+    return snprintf(buf, size,
+                    "count=%llu mean_ns=%llu p50_ns=%llu p90_ns=%llu "
+                    "p99_ns=%llu max_ns=%llu",
+                    (unsigned long long)hist->count,
+                    (unsigned long long)(hist->count ? hist->sum / hist->count
+                                                     : 0),
+                    (unsigned long long)percentileHistogram(hist, 50),
+                    (unsigned long long)percentileHistogram(hist, 90),
+                    (unsigned long long)percentileHistogram(hist, 99),
+                    (unsigned long long)hist->max);
+}
@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram of durations in nanoseconds, as HdrHistogram does:
+// values below 2^HIST_SUB_BITS get a bucket each, every power of two above
+// is split into 2^(HIST_SUB_BITS-1) buckets, so percentiles are off by at
+// most 1/16. Recording is a few instructions and never allocates.
+#define HIST_SUB_BITS 5
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} Histogram;
+
+// largest value counted in bucket idx
+uint64_t histogramValue(int idx);
+// value below which pct percent of the samples fall, 0 if there are none
+uint64_t percentileHistogram(const Histogram* hist, double pct);
+// "count=.. mean_ns=.. p50_ns=.. p90_ns=.. p99_ns=.. max_ns=..", as
+// snprintf() returns
+int formatHistogram(char* buf, size_t size, const Histogram* hist);
+
+static inline int histogramIndex(uint64_t value) {
+    if (value < (1u << HIST_SUB_BITS))
+        return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+    return (shift + 1) * HIST_HALF + (int)(value >> shift) - HIST_HALF;
+}
+
+static inline void recordHistogram(Histogram* hist, uint64_t value) {
+    ++hist->buckets[histogramIndex(value)];
+    ++hist->count;
+    hist->sum += value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+#endif
@@ -0,0 +1,264 @@
+// Compare lookup throughput of the text and the binary protocol, e.g.
+//   ./read_server -k -B 3334 3333 &
+//   ./protobench -p $! localhost 3333 3334
+// One connection per protocol keeps -q lookups in flight for -d seconds:
+// "id\n" lines, then BIN_LOOKUP requests, then BIN_BATCH_LOOKUP requests of
+// BIN_BATCH_MAX ids. With -p the server's CPU time per lookup is reported.
+// First it checks that malformed requests get BIN_FAILED and are closed.
+
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "binproto.h"
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+static struct sockaddr_in svrAddr;
+static int firstId = 902001, nIds = 20, depth = 16;
+static double duration = 3;
+static int svrPid = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// user + system time of the server in seconds, 0 without -p
+static double serverCpu() {
+    if (svrPid == 0)
+        return 0;
+    char path[64];
+    sprintf(path, "/proc/%d/stat", svrPid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        ERR_EXIT("fopen");
+    unsigned long utime = 0, stime = 0;
+    // skip pid and (comm), then fields 3-13
+    if (fscanf(f,
+               "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        utime = stime = 0;
+    fclose(f);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int connectTo(unsigned short port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        ERR_EXIT("socket");
+    struct sockaddr_in addr = svrAddr;
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        ERR_EXIT("connect");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void writeAll(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            ERR_EXIT("write");
+        buf += n;
+        len -= n;
+    }
+}
+
+// read until that many lines have arrived
+static void readText(int fd, long lines) {
+    char buf[4096];
+    while (lines > 0) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr,
+                    "connection closed, is the server run with -k?\n");
+            exit(1);
+        }
+        for (ssize_t i = 0; i < n; ++i)
+            lines -= buf[i] == '\n';
+    }
+}
+
+// read that many bytes of replies, returns how many of them are BIN_OK
+static long readBinary(int fd, size_t bytes) {
+    static char buf[1 << 16];
+    long ok = 0;
+    size_t have = 0;
+    while (have < bytes) {
+        size_t want = bytes - have < sizeof(buf) ? bytes - have : sizeof(buf);
+        ssize_t n = read(fd, buf, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, "connection closed by server\n");
+            exit(1);
+        }
+        // status is the first byte of every reply
+        for (ssize_t i = 0; i < n; ++i)
+            if ((have + i) % sizeof(BinReply) == 0)
+                ok += buf[i] == BIN_OK;
+        have += n;
+    }
+    return ok;
+}
+
+static void report(const char* name, long lookups, double secs, double cpu) {
+    printf("%-14s %9.0f lookups/s", name, lookups / secs);
+    if (svrPid)
+        printf("  server %.2fus/lookup", cpu * 1e6 / lookups);
+    printf("\n");
+}
+
+static void benchText(unsigned short port) {
+    int fd = connectTo(port);
+    readText(fd, 1);  // prompt
+    char* batch = (char*)malloc(depth * 16);
+    long lookups = 0;
+    int next = 0;
+    double cpu = serverCpu(), start = now(), end = start + duration;
+    while (now() < end) {
+        size_t len = 0;
+        for (int i = 0; i < depth; ++i, next = (next + 1) % nIds)
+            len += sprintf(batch + len, "%d\n", firstId + next);
+        writeAll(fd, batch, len);
+        readText(fd, 2L * depth);  // reply and the next prompt
+        lookups += depth;
+    }
+    report("text", lookups, now() - start, serverCpu() - cpu);
+    free(batch);
+    close(fd);
+}
+
+static void benchBinary(unsigned short port, int perRequest) {
+    int fd = connectTo(port);
+    size_t reqLen = sizeof(BinRequest) +
+                    (perRequest > 1 ? perRequest * sizeof(int32_t) : 0);
+    char* batch = (char*)malloc(depth * reqLen);
+    long lookups = 0, ok = 0;
+    int next = 0;
+    double cpu = serverCpu(), start = now(), end = start + duration;
+    while (now() < end) {
+        for (int i = 0; i < depth; ++i) {
+            BinRequest req = {.op = perRequest > 1 ? BIN_BATCH_LOOKUP
+                                                   : BIN_LOOKUP};
+            char* p = batch + i * reqLen;
+            if (perRequest > 1) {
+                req.count = htole16(perRequest);
+                for (int j = 0; j < perRequest; ++j) {
+                    int32_t id = htole32(firstId + next);
+                    memcpy(p + sizeof(req) + j * sizeof(id), &id, sizeof(id));
+                    next = (next + 1) % nIds;
+                }
+            } else {
+                req.id = htole32(firstId + next);
+                next = (next + 1) % nIds;
+            }
+            memcpy(p, &req, sizeof(req));
+        }
+        writeAll(fd, batch, depth * reqLen);
+        ok += readBinary(fd, (size_t)depth * perRequest * sizeof(BinReply));
+        lookups += (long)depth * perRequest;
+    }
+    report(perRequest > 1 ? "binary batch" : "binary", lookups, now() - start,
+           serverCpu() - cpu);
+    if (ok != lookups)
+        fprintf(stderr, "%ld of %ld lookups failed\n", lookups - ok, lookups);
+    free(batch);
+    close(fd);
+}
+
+// send one malformed request, it must be answered with BIN_FAILED and EOF
+static void checkMalformed(unsigned short port, const char* what,
+                           BinRequest req) {
+    int fd = connectTo(port);
+    writeAll(fd, (const char*)&req, sizeof(req));
+    BinReply reply;
+    size_t have = 0;
+    while (have < sizeof(reply)) {
+        ssize_t n = read(fd, (char*)&reply + have, sizeof(reply) - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        have += n;
+    }
+    char extra;
+    ssize_t n;
+    while ((n = read(fd, &extra, 1)) < 0 && errno == EINTR)
+        ;
+    if (have != sizeof(reply) || reply.status != BIN_FAILED || n != 0) {
+        fprintf(stderr, "%s: expected BIN_FAILED and a close\n", what);
+        exit(1);
+    }
+    close(fd);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:n:p:q:")) != -1) {
+        switch (opt) {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'i':
+            firstId = atoi(optarg);
+            break;
+        case 'n':
+            nIds = atoi(optarg);
+            break;
+        case 'p':
+            svrPid = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 3 || duration <= 0 || nIds <= 0 || depth <= 0) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-d seconds] [-i first id] [-n ids] [-p server pid] "
+                "[-q depth] host text-port binary-port\n",
+                argv[0]);
+        exit(1);
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (host == NULL) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        exit(1);
+    }
+    svrAddr.sin_family = AF_INET;
+    memcpy(&svrAddr.sin_addr, host->h_addr_list[0], host->h_length);
+
+    checkMalformed(atoi(argv[optind + 2]), "unknown op",
+                   (BinRequest){.op = 0xff, .id = htole32(firstId)});
+    checkMalformed(atoi(argv[optind + 2]), "oversized batch",
+                   (BinRequest){.op = BIN_BATCH_LOOKUP,
+                                .count = htole16(BIN_BATCH_MAX + 1)});
+    benchText(atoi(argv[optind + 1]));
+    benchBinary(atoi(argv[optind + 2]), 1);
+    benchBinary(atoi(argv[optind + 2]), BIN_BATCH_MAX);
+    return 0;
+}
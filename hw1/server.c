@@ -1,32 +1,112 @@
+#define _GNU_SOURCE  // accept4(), close_range(), mremap()
 
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef USE_POLL
+#include <sys/epoll.h>
+#endif
+#include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "binproto.h"
+#include "csiemask.h"
+#include "feed.h"
+#include "idindex.h"
+#include "inventory.h"
+#include "locktable.h"
+#include "metrics.h"
+#include "timerwheel.h"
+#include "uring.h"
+#include "wal.h"
+
 #define ERR_EXIT(a) \
     do {            \
         perror(a);  \
         exit(1);    \
     } while (0)
-#define writeStr(fd, str) write((fd), (str), strlen((str)))
+#define OUT_SEGMENTS 8  // queued output segments per connection
+#define REPLY_MAX 96     // longest formatted reply
+#define BIN_REPLY_MAX (BIN_BATCH_MAX * sizeof(BinReply))  // to one request
+#define BATCH_IOV 1024  // IOV_MAX on Linux
+#define EVENT_BATCH 1024  // events taken per epoll_wait()
+#define URING_ENTRIES 1024  // submission queue of -U, 4 times as many CQEs
+#define STAGE_SIZE 512  // -U: bytes a request reads ahead into its slab
+#define ACCEPT_BUDGET 64  // connections accepted per event loop round
+#define REQUESTS_PER_SLAB 64  // requests allocated at a time
+#define CACHE_LINE 64
 
 // manage file descriptors to poll
+// Compile with -D USE_POLL to fall back to poll(), edge-triggered epoll
+// otherwise.
+#ifdef USE_POLL
 struct pollfd* pollFds;
-int pollFdsLen;
-static void appendFd(int fd);
-static void removeFd(int fd);
+struct Request** pollReqs;  // the request of each entry in pollFds
+int pollFdsLen, pollFdsCap;
+#else
+int epollFd;
+struct epoll_event* epollEvents;
+#endif
+static void initPoller();
+static int waitEvents(int timeout);
+struct Request;
+static void appendFd(struct Request* req);
+static void removeFd(struct Request* req);
+static void setNonBlocking(int fd);
+static void updateEvents(struct Request* req);
+static void setAccepting(bool accepting);
+//
+
+// io_uring
+// -U: instead of being polled, clients are read and written by operations
+// submitted to ring, all of a loop round with the io_uring_enter() that
+// waits for the next completions. A client's fd is its slot in the ring's
+// fixed files and it reads ahead into a staging area that follows its slab,
+// a registered buffer. The poller above is used if the kernel has no
+// io_uring. Completions carry the request and the operation in user_data,
+// 0 for those nothing waits on.
+#define URING_RECV 1  // a read into the staging area
+#define URING_SEND 2  // a writev of the output queue
+#define URING_POLL 3  // a listener is ready to accept
+#define URING_OPS 3
+bool useUring = false;  // -U
+Uring ring = {.fd = -1};
+int fixedFiles;  // fds below this are fixed files of ring
+int bufferSlots, fixedSlabs;  // slabs[0..fixedSlabs) are registered buffers
+static bool initUringPoller();
+static int waitUring(int timeout);
+static struct io_uring_sqe* takeSqe(Uring* uring);
+static void setSqeFd(struct io_uring_sqe* sqe, int fd);
+static void armListener(struct Request* req);
+static void appendUringFd(struct Request* req);
+static void removeUringFd(struct Request* req);
+static void setUringAccepting(bool accepting);
+static void registerSlab(int slabIdx);
+static char* stageOf(struct Request* req);
+static ssize_t receive(struct Request* req, char* buf, size_t room);
+static void sendOutput(struct Request* req);
 //
 
 // Server
@@ -34,29 +114,152 @@ typedef struct {
     char hostname[512];   // server's hostname
     unsigned short port;  // port to listen
     int listen_fd;        // fd to wait for a new connection
+    unsigned short binPort;  // -B: port for the binary protocol, 0 if none
+    int bin_fd;              // fd to wait for a binary client, -1 if none
+    unsigned short adminPort;  // -A: port for stats commands, 0 if none
+    int admin_fd;              // fd to wait for an admin client, -1 if none
+    unsigned short readPort;  // -R: port for read_server's clients, 0 if none
+    int read_fd;              // fd to wait for such a client, -1 if none
 } Server;
 Server svr;  // server
-char buf[512];
 struct sockaddr_in cliAddr;  // used by accept()
 int cliLen = sizeof(cliAddr);
-int maxFd;  // size of open file descriptor table, size of request list
-int recordFd;
+int maxFd;  // size of open file descriptor table
+const char* recordPath = "./preorderRecord";  // -f: the records served
+volatile sig_atomic_t stopping = 0;  // set by SIGINT/SIGTERM
+int nWorkers = 0;  // -w: processes sharing the port with SO_REUSEPORT
+bool keepAlive = false;  // -k: ask for the next id instead of closing
+// A command ends with '\n'. Input without one is taken as a whole command
+// once the client has been quiet for lineGraceMs, for clients like
+// csieMask-score.py that never send it; a line split by a longer pause is
+// then cut short. -G 0 always waits for the newline.
+int lineGraceMs = 50;
+int maxConns = 0;  // -c: clients served at once, 0 for as many as fds allow
+int nConns = 0;
+int nAdminConns = 0;  // of nConns, -A clients are not held to -c
+bool acceptPaused = false;  // listen_fd is not polled until a client leaves,
+                            // the admin port stays open to look into why
+bool acceptMore = false;    // the budget ran out before the backlog did
+int reserveFd = -1;  // closed to make room for shedding a client
 static void initServer(unsigned short port);
-static int acceptAndBlock();
+static int listenOn(unsigned short port);
+static void forkWorkers();
+struct Request;
+static int acceptAndBlock(struct Request* from);
+static int shedClient(struct Request* from);
 //
 
 // Request
-typedef struct {
-    char host[512];  // client's host
-    int conn_fd;     // fd to talk with client
-    char buf[512];   // data sent by/to client
-    size_t buf_len;  // bytes used by buf
-    // you don't need to change this.
+// Fields touched on every event come first and share one cache line.
+typedef struct Request {
+    _Alignas(CACHE_LINE) int conn_fd;  // fd to talk with client
     int id;
     int nextActionId;  // used by handle_read to know if the header is read or
                        // not.
+    bool pending;      // waiting for its order to be committed
+    bool lineDue;      // grace period is over, take buf as a line
+    bool skipLine;     // drop input up to the next '\n', it was too long
+    bool closing;      // close once out is flushed
+    bool binary;       // speaks binproto.h, came in through svr.bin_fd
+    bool admin;        // sends stats commands, came in through svr.admin_fd
+    bool recvBusy;     // -U: a read is submitted, for a listener its poll
+    bool sendBusy;     // -U: a writev of out is submitted
+    short staged;      // -U: bytes read ahead, -1 at EOF, -2 after an error
+    unsigned short slab;  // index in slabs, set when the slab is carved
+    size_t buf_len;    // bytes used by buf
+    size_t line_len;   // bytes of buf taken by the current line
+    short outHead, outLen;  // replies not written yet, out[outHead..+outLen)
+    bool reader;  // came in through svr.read_fd, only looks records up
+    size_t outTextLen;
+    struct in_addr addr;  // client's address
+#ifdef USE_POLL
+    int pollIdx;  // index in pollFds, -1 if not polled
+#endif
+    struct iovec out[OUT_SEGMENTS];
+    char* outText;  // formatted segments of out live here, outInline or
+                    // a heap buffer for binary clients
+    size_t outTextCap;
+    char outInline[2 * REPLY_MAX];
+    Timer graceTimer;  // takes a partial line as a command when it fires
+    Timer stateTimer;  // the client took too long to send a command
+    Timer lockTimer;   // a record has been locked for too long
+    struct Request* nextFree;  // in freeRequests
+    struct Bulk* bulk;  // bulk command being collected or answered
+    char buf[512];  // data sent by client, the current line is '\0' ended
 } Request;
-Request* requests = NULL;  // point to a list of requests
+_Static_assert(offsetof(Request, out) <= CACHE_LINE,
+               "hot fields of Request do not fit in a cache line");
+// Requests are carved out of slabs as connections arrive and recycled
+// through freeRequests, a slab is only freed on exit. A freed request stays
+// readable with conn_fd -1 for events already fetched.
+Request** slabs = NULL;
+int slabsLen, slabsCap;
+Request* freeRequests = NULL;
+// svr.listen_fd, svr.bin_fd, svr.admin_fd and svr.read_fd in the poller
+Request listener, binListener, adminListener, readListener;
+#define N_LISTENERS 4
+Request* const listeners[N_LISTENERS] = {&listener, &binListener,
+                                         &adminListener, &readListener};
+static bool isListener(Request* req);
+static Request* allocRequest();
+static void freeRequest(Request* req);
+static void releaseRequest(Request* req);
+// -t: ms a client gets to send an id, to send an order and to hold a lock,
+// 0 for no limit
+int idTimeout = 60000, orderTimeout = 30000, lockTimeout = 30000;
+TimerWheel timers;  // per request deadlines, one tick per ms
+#define REQUEST_OF(timer, member) \
+    ((Request*)((char*)(timer) - offsetof(Request, member)))
+static void armTimer(Timer* timer, int ms);
+static void onGraceTimer(Timer* timer);
+static void onStateTimer(Timer* timer);
+static void onLockTimer(Timer* timer);
+static long nowMs();
+static uint64_t nowNs();
+//
+
+// Metrics
+// Per process counters and histograms, cheap enough to be always on. -A
+// answers "stats" with them, -M dumps them to a file every few seconds.
+// Counts are exact, durations are only taken for one in STATS_SAMPLE
+// handler calls and lock attempts: reading the clock is what costs.
+typedef enum {
+    H_START,  // H_START..H_ORDER are indices of actions[]
+    H_LOOKUP,
+    H_ORDER,
+    H_BINARY,
+    H_BULK,
+    H_ADMIN,
+    N_HANDLERS
+} HandlerKind;
+static const char* const handlerNames[N_HANDLERS] = {
+    "start", "lookup", "order", "binary", "bulk", "admin"};
+#define STATS_SAMPLE 16  // a power of 2
+typedef struct {
+    uint64_t handled[N_HANDLERS];  // commands handled
+    uint64_t accepted, shed, timedOut;
+    uint64_t bytesIn, bytesOut;
+    uint64_t wakeups, events;  // returns of the poller or io_uring_enter(),
+                               // fds ready or operations completed
+    uint64_t lockAcquired, lockFailed;
+    uint64_t feedApplied, feedResyncs;  // -r replica
+    Histogram handlers[N_HANDLERS];  // time to handle a command
+    Histogram lockWait;  // time in fcntl() or the lock table per attempt
+    Histogram feedLag;   // from publishing a feed entry to applying it
+    unsigned ticks;      // picks the samples
+} Metrics;
+Metrics metrics;
+long startedMs;
+char* statsPath = NULL;  // -M
+int statsInterval = 10;  // seconds between dumps to statsPath
+Timer statsTimer;
+#define STATS_MAX 4096        // longest stats dump
+#define STATS_TOP_RECORDS 10  // most contended records listed
+static int formatStats(char* buf, size_t size);
+static void dumpStats();
+static void onStatsTimer(Timer* timer);
+static void resetStats();
+static uint64_t startSample();
 //
 
 // IO
@@ -64,163 +267,554 @@ typedef enum { UNLCK, RDLCK, WRLCK } LockStat;  // UNLCK == 0, easier to memset
 typedef struct {
     LockStat status;
     Request* owner;
+    uint32_t acquired, failed;  // lock attempts on the record, for stats
 } LockInfo;
-typedef struct {
-    int id;  // 902001-902020, customer id, set to negative if this process
-             // have write lock on the section
-    int adultMask;     // set to 10 by default
-    int childrenMask;  // set to 10 by default
-} Order;
-Order* idInfo = NULL;  // only used to find id
+CsieMask core;  // the record file, core.orders, the id index and the locks
 LockInfo* lockInfo =
     NULL;  // The type of lock acquired by this process at the offset
-int idInfoLen;
+// records lockInfo, pendingOrders, walBuf and the stock columns can hold
+int lockInfoCap;
+// core.orders is the record of truth, lookups are answered from it: with -L
+// or -R this process is the only writer and writes go through it to the
+// file, a -r read_server follows the writer into it
+bool ownRecords = false;
 static Order orderBuf;
-static int initializeIdInfo();
-static ssize_t safeRead(int fd, char* buf, size_t count);
-static int acquireLock(int fd, short type, short whence, off_t offset,
-                       off_t len);
+// -m: preorderRecord is mapped MAP_SHARED and accessed in place
+typedef enum { SYNC_WRITE, SYNC_PERIODIC, SYNC_SHUTDOWN } SyncPolicy;
+Order* records = NULL;  // the mapping, NULL when using read/write
+size_t recordsSize;     // bytes mapped
+SyncPolicy syncPolicy;
+int syncInterval;             // seconds, SYNC_PERIODIC only
+struct timespec nextSync;     // SYNC_PERIODIC only
+static int initializeRecords();
+static int growRecords();
+static int extendRecords(CsieMask* db, int len, void* arg);
+static void onGrowTimer(Timer* timer);
+// an append is taken in and indexed this many records a tick, lookups scan
+// the records not indexed yet meanwhile
+#define GROW_CHUNK 16384
+Timer growTimer;
+static int mapRecords();
+static int syncRecords();
+static int syncTimeout();
+static int readRecord(int idx, Order* order);
+#ifndef READ_SERVER
+static int writeRecord(int idx, const Order* order);
+#endif
+static int msyncRecords(int first, int last);
+// the stock of core.orders again as one column per SKU, for the admin
+// reports; the writes of this process go to both, the point lookups read
+// only core.orders
+#define BELOW_LIST_MAX 256     // ids listed by "below"
+#define BELOW_LINE_MAX 32      // an "id stock" line and "...", at most
+#define STOCK_REFRESH_MS 1000  // how late they see other servers' writes
+const char* const skuNames[] = {"adult", "children"};
+Inventory inventory;
+static void storeRecord(int idx, const Order* order);
+static void loadStock(int first, int last);
+static int refreshStock();
+static int formatTotal(char* buf, size_t size);
+static int formatBelow(char* buf, size_t size, int sku, int threshold);
+// -g: orders are written and synced in batches, replies wait for the batch
+typedef enum { BARRIER_NONE, BARRIER_FDATASYNC, BARRIER_FSYNC } Barrier;
+typedef struct {
+    Request* req;
+    int idx;
+    Order order;
+    int orderAdult;
+    int orderChild;
+} PendingOrder;
+PendingOrder* pendingOrders = NULL;  // at most one per record
+int pendingOrdersLen;
+long groupWindow = -1;  // microseconds, -1 to write every order at once
+Barrier barrier = BARRIER_FDATASYNC;
+struct timespec groupDeadline;
+static int groupTimeout();
+static void flushOrders();
+static int writeOrders();
+static int syncOrders();
+// -U: the runs of adjacent records a batch reads or writes are queued on
+// fileRing, a readv/writev each, and go to the kernel in one submission
+// together with the -b barrier
+typedef struct {
+    size_t total;  // bytes the run transfers
+    bool* failed;  // set if it transfers fewer
+} QueuedRun;
+Uring fileRing = {.fd = -1};
+bool fixedRecordFd;  // core.fd is fixed file 0 of fileRing
+struct iovec runIov[BATCH_IOV];
+QueuedRun queuedRuns[BATCH_IOV];
+int runIovLen, queuedRunsLen;
+static void initRecordRing();
+static void queueRun(bool write, const struct iovec* iov, int n, off_t offset,
+                     bool* failed);
+static int submitRuns(bool sync);
+// -L: orders are appended to preorderRecord.wal and core.orders is the
+// record of truth. Every compactEvery orders a forked child writes
+// core.orders over preorderRecord, read_server's view, and the log drops
+// what it wrote.
+char* logPath = NULL;  // recordPath with ".wal" appended
+#define SNAPSHOT_CHUNK 4096  // records written under one lock
+Wal wal = {.fd = -1};  // wal.path is NULL without -L
+WalEntry* walBuf = NULL;  // entries of one append
+long compactEvery = 0;
+pid_t compactPid = 0;  // the child writing a snapshot, 0 if none
+uint64_t compactLsn;   // the last entry in that snapshot
+static int openLog();
+static void closeLog();
+static void applyLogEntry(const WalEntry* entry, void* arg);
+static int logRecords(int n);
+static int writeSnapshot();
+static void startCompaction();
+static void reapCompaction(bool wait);
+// -r: write_server publishes every write lock, committed record and unlock
+// to the feed of preorderRecord, a read_server replica applies the feed to
+// core.orders and lockInfo and needs no file locks
+#define FEED_POLL_MS 10  // an idle replica catches up this often
+#define FEED_BATCH 64    // entries copied at once
+Feed feed;  // feed.ring is NULL without -r
+int feedLocked;  // replica: records write-locked according to the feed
+Timer feedTimer;
+static void followFeed();
+static int resyncReplica();
+static void unlockFeedRecords();
+static void onFeedTimer(Timer* timer);
 static int acquireLockBlocking(int fd, short type, short whence, off_t offset,
                                off_t len);
+static void countLock(int idx, int ret, uint64_t ns);
 static int tryAcquireReadLock(Request* req, int idx);
 static int tryAcquireWriteLock(Request* req, int idx);
 static int releaseLock(Request* req, int idx);
 static int getIndexOfId(int id);
-static off_t getFileSize(int fd);
 //
 
 // Action
-typedef enum { SUCCESS, FAILED, LOCKED } Result;
+// AGAIN: no input yet, PENDING: the reply is sent by flushOrders(),
+// CLOSED: the client left between two commands (-k)
+typedef enum { SUCCESS, FAILED, LOCKED, AGAIN, PENDING, CLOSED } Result;
 typedef Result (*RequestHandler)(Request*);
 typedef struct {
     const char* prompt;
     RequestHandler handler;
+    const int* timeout;  // ms to wait for the command, NULL for no limit
 } Action;
 static void initRequest(Request*);
 static void cleanUpRequest(Request*);
+static void releaseHeldLock(Request*);
+static void closeRequest(Request*);
+static void serveRequest(Request*);
+static void queueStr(Request* req, const char* str);
+static void queueText(Request* req, const char* fmt, ...);
+static bool hasOutputRoom(Request* req);
+static int flushOutput(Request* req);
+static void dropOutput(Request* req, size_t n);
+static bool finishAction(Request*, Result);
+static void acceptRequests(Request* from);
 static int readRequest(Request* req);
 static Result startRequest(Request*);
 static Result lookUpRecord(Request*);
+#ifndef READ_SERVER
 static Result handleOrder(Request*);
+#endif
+static Result handleBinary(Request*);
+static Result handleAdmin(Request*);
+static int readFrame(Request* req);
+static Result loadRecord(Request* req, int idx, bool lock);
+#ifndef READ_SERVER
+static Result placeOrder(Request* req, int idx, int orderAdult,
+                         int orderChild);
+#endif
+static void replyOrder(Request* req, int orderAdult, int orderChild);
+static void replyBinary(Request* req, Result res, int id, const Order* order);
+static void queueBytes(Request* req, const void* data, size_t len);
+static Result copyRecord(Request* req, int idx, Order* order);
+//
+
+// Bulk
+// "bulk lookup" or "bulk order all|any" at the id prompt, followed by ids or
+// by "id adult|children count" triples on the same and the next lines, up
+// to a blank line. Each item is answered on a line of its own, in order:
+// "id ok adult children" with the masks left, "id locked", "id failed", or
+// "id aborted" when an all-or-nothing order gave up on the rest.
+#define BULK_MAX 4096  // items per bulk command
+#define BULK_LINE_MAX 40  // longest reply line of an item
+typedef struct {
+    int id;
+    int idx;  // in core.orders, -1 if unknown
+    int pos;  // in the command, replies keep this order
+    int rec;  // in the records of the command
+    int orderAdult;
+    int orderChild;
+    Result res;   // AGAIN: aborted
+    Order order;  // the record after this item
+} BulkItem;
+typedef struct {
+    int idx;
+    Result res;  // SUCCESS once locked and read, AGAIN if not tried
+    bool dirty;  // changed by an order
+    bool failed;  // -U: the queued run starting here came up short
+    Order order;
+} BulkRecord;
+typedef struct Bulk {
+    bool order;   // lookups otherwise
+    bool atomic;  // all: every order succeeds or none is written
+    bool bad;     // malformed, answered with failedMsg after the blank line
+    int len, cap;
+    BulkItem* items;
+    char* reply;  // queued as one segment, the next command waits for it
+} Bulk;
+static Result startBulk(Request* req);
+static Result handleBulk(Request* req);
+static int parseInt(const char* str, int* value);
+static int parseBulkItems(Bulk* bulk, char* line);
+static void runBulk(Request* req, Bulk* bulk);
+static int transferBulk(BulkRecord* recs, int nRecs, bool write);
+static int bulkRunEnd(BulkRecord* recs, int nRecs, int r, bool write);
+static int finishBulkRun(BulkRecord* recs, int r, int j, bool write, bool ok);
+static int transferLog(BulkRecord* recs, int nRecs, bool write);
+static void replyBulk(Request* req, Bulk* bulk);
+static void freeBulk(Request* req);
 //
 
+static const char lockedMsg[] = "Locked.\n";
+static const char failedMsg[] = "Operation failed.\n";
+
 // action taken when a file is ready to be read
 Action actions[] = {
     {.prompt = NULL, .handler = startRequest},
     {.prompt =
          "Please enter the id (to check how many masks can be ordered):\n",
-     .handler = lookUpRecord},
+     .handler = lookUpRecord,
+     .timeout = &idTimeout},
 #ifndef READ_SERVER
     {.prompt = "Please enter the mask type (adult or children) and number of "
                "mask you would like to order:\n",
-     .handler = handleOrder},
+     .handler = handleOrder,
+     .timeout = &orderTimeout},
 #endif
 };
 
 int actionsLen = sizeof(actions) / sizeof(actions[0]);
 
+static void onStop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
 int main(int argc, char* argv[]) {
     // Parse args.
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s [port]\n", argv[0]);
+    bool useMmap = false, useLockTable = false, useFeed = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "A:B:b:c:f:G:g:kL:lM:m:R:rt:Uw:")) != -1) {
+        switch (opt) {
+        case 'A':
+            if ((svr.adminPort = atoi(optarg)) == 0)
+                goto usage;
+            break;
+        case 'B':
+            if ((svr.binPort = atoi(optarg)) == 0)
+                goto usage;
+            break;
+        case 'b':
+            if (strcmp(optarg, "none") == 0)
+                barrier = BARRIER_NONE;
+            else if (strcmp(optarg, "fdatasync") == 0)
+                barrier = BARRIER_FDATASYNC;
+            else if (strcmp(optarg, "fsync") == 0)
+                barrier = BARRIER_FSYNC;
+            else
+                goto usage;
+            break;
+        case 'c':
+            if ((maxConns = atoi(optarg)) <= 0)
+                goto usage;
+            break;
+        case 'f':
+            recordPath = optarg;
+            break;
+        case 'G':
+            if ((lineGraceMs = atoi(optarg)) < 0)
+                goto usage;
+            break;
+        case 'g':
+            if ((groupWindow = atol(optarg)) < 0)
+                goto usage;
+            break;
+        case 'k':
+            keepAlive = true;
+            break;
+#ifndef READ_SERVER
+        case 'L':
+            if ((compactEvery = atol(optarg)) <= 0)
+                goto usage;
+            break;
+        case 'R':
+            if ((svr.readPort = atoi(optarg)) == 0)
+                goto usage;
+            break;
+#endif
+        case 'r':
+            useFeed = true;
+            break;
+        case 'l':
+            useLockTable = true;
+            break;
+        case 'M': {
+            char* comma = strrchr(optarg, ',');
+            if (comma) {
+                *comma = '\0';
+                if ((statsInterval = atoi(comma + 1)) <= 0)
+                    goto usage;
+            }
+            statsPath = optarg;
+            break;
+        }
+        case 'm':
+            useMmap = true;
+            if (strcmp(optarg, "write") == 0) {
+                syncPolicy = SYNC_WRITE;
+            } else if (strcmp(optarg, "shutdown") == 0) {
+                syncPolicy = SYNC_SHUTDOWN;
+            } else if ((syncInterval = atoi(optarg)) > 0) {
+                syncPolicy = SYNC_PERIODIC;
+            } else {
+                goto usage;
+            }
+            break;
+        case 't':
+            if (sscanf(optarg, "%d,%d,%d", &idTimeout, &orderTimeout,
+                       &lockTimeout) != 3 ||
+                idTimeout < 0 || orderTimeout < 0 || lockTimeout < 0)
+                goto usage;
+            break;
+        case 'U':
+            useUring = true;
+            break;
+        case 'w':
+            if ((nWorkers = atoi(optarg)) <= 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+#ifdef READ_SERVER
+    ownRecords = useFeed;  // every worker is a replica of its own
+#else
+    // -L, -R and -r keep the records in this process only
+    ownRecords = compactEvery || svr.readPort;
+    if (nWorkers && (ownRecords || useFeed))
+        goto usage;
+#endif
+    // replicas copy preorderRecord, which -L only writes now and then
+    if (argc - optind != 1 || (compactEvery && (useMmap || useFeed))) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-A port] [-B port] [-b none|fdatasync|fsync] "
+                "[-c conns] [-f file] [-G ms] [-g usec] [-k] [-L orders] [-l] "
+                "[-M file[,seconds]] "
+                "[-m write|shutdown|seconds] [-R port] [-r] "
+                "[-t id,order,lock] [-U] [-w workers] [port]\n"
+                "  -A  answer \"stats\", \"reset\", \"total\" and "
+                "\"below adult|children n\" on port;\n"
+                "      the reports see writes of other servers up to 1 s "
+                "late\n"
+                "  -B  serve the binary protocol of binproto.h on port as "
+                "well\n"
+                "  -c  stop accepting while conns clients are connected, "
+                "-A clients aside\n"
+                "  -f  serve the records in file instead of ./preorderRecord, "
+                "e.g. a shard\n"
+                "      written by splitrecords\n"
+                "  -G  take input without a newline as a command after ms "
+                "of silence (default 50),\n"
+                "      0 to wait for the newline\n"
+                "  -g  commit orders in batches collected for usec, 0 for "
+                "one event loop round;\n"
+                "      -b sets the barrier after each batch (default "
+                "fdatasync)\n"
+                "  -k  keep connections open, clients may pipeline commands\n"
+                "  -L  write_server: append orders to preorderRecord.wal, "
+                "rewrite preorderRecord\n"
+                "      from memory every that many orders; not with -m or "
+                "-w\n"
+                "  -l  lock records in shared memory instead of fcntl, all "
+                "servers of a file must agree;\n"
+                "      read_server then copies records without locking\n"
+                "  -M  write stats to file every 10 or that many seconds, "
+                "file.pid with -w\n"
+                "  -m  mmap preorderRecord, msync per write, on shutdown or "
+                "periodically\n"
+                "  -R  write_server: serve read_server's clients on port as "
+                "well, from memory;\n"
+                "      not with -w\n"
+                "  -r  write_server: publish locks and committed records to "
+                "replicas, as the only\n"
+                "      write_server of the file; not with -L or -w\n"
+                "      read_server: be a replica, answer from memory without "
+                "file locks\n"
+                "  -t  ms to wait for an id, for an order and to hold a lock "
+                "before closing,\n"
+                "      0 for no limit (default 60000,30000,30000)\n"
+                "  -U  talk to clients and write batches of records through "
+                "io_uring,\n"
+                "      falls back to polling if the kernel has none\n"
+                "  -w  fork worker processes sharing the port\n",
+                argv[0]);
         exit(1);
     }
 
-    initializeIdInfo();
+    // leave the loop on SIGINT/SIGTERM so that records get synced
+    struct sigaction act = {.sa_handler = onStop};  // no SA_RESTART
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);  // clients may leave before the reply
+
+    if (initializeRecords() < 0)
+        ERR_EXIT(recordPath);
+    if (useMmap && mapRecords() < 0)
+        ERR_EXIT("failed to mmap the records");
+    if (nWorkers > 0)
+        forkWorkers();  // only returns in a worker
+    if (useLockTable && attachLockTable(&core.table, core.fd, core.len) < 0)
+        ERR_EXIT("failed to attach the shared lock table");
+#ifdef READ_SERVER
+    if (useFeed &&
+        (openFeed(&feed, core.fd, false) < 0 || resyncReplica() < 0))
+        ERR_EXIT("failed to follow the feed of the records");
+#else
+    if (useFeed && openFeed(&feed, core.fd, true) < 0)
+        ERR_EXIT("failed to publish the feed of the records");
+#endif
+    if (groupWindow >= 0) {
+        pendingOrders =
+            (PendingOrder*)malloc(sizeof(PendingOrder) * (lockInfoCap + 1));
+        if (pendingOrders == NULL)
+            ERR_EXIT("out of memory allocating pendingOrders");
+        pendingOrdersLen = 0;
+    }
+    if (compactEvery && openLog() < 0)
+        ERR_EXIT("failed to recover from the log");
 
     // Initialize server
-    initServer((unsigned short)atoi(argv[1]));
+    startedMs = nowMs();
+    initTimerWheel(&timers, startedMs);
+    initServer((unsigned short)atoi(argv[optind]));
+    if (useUring && ring.fd >= 0)
+        initRecordRing();
+    if (statsPath) {
+        if (nWorkers > 0) {
+            // one file per worker
+            char* path = (char*)malloc(strlen(statsPath) + 16);
+            if (path == NULL)
+                ERR_EXIT("out of memory allocating the stats path");
+            sprintf(path, "%s.%d", statsPath, (int)getpid());
+            statsPath = path;
+        }
+        initTimer(&statsTimer, onStatsTimer);
+        armTimer(&statsTimer, statsInterval * 1000);
+    }
+    if (feed.ring && !feed.writer) {
+        initTimer(&feedTimer, onFeedTimer);
+        armTimer(&feedTimer, FEED_POLL_MS);
+    }
 
     // Loop for handling connections
     fprintf(stderr, "\nstarting on %.80s, port %d, fd %d, maxconn %d...\n",
             svr.hostname, svr.port, svr.listen_fd, maxFd);
 
-    while (1) {
-#ifndef NDEBUG
-        fprintf(stderr, "Now polling: (");
-        for (int i = 0; i < pollFdsLen; ++i) {
-            fprintf(stderr, "%d, ", pollFds[i].fd);
-        }
-        fprintf(stderr, ")\n");
-        fprintf(stderr, "<<< start polling ......");
-#endif
-        int totalFd = poll(pollFds, pollFdsLen, -1);
-#ifndef NDEBUG
-        fprintf(stderr, "end polling, %d ready >>>\n", totalFd);
-#endif
-        // timeout == -1, totalFd != 0
-        if (totalFd < 0) {
-            ERR_EXIT("poll");
-        }
-        for (int i = 0; i < pollFdsLen;) {
-            if (pollFds[i].revents == 0) {
-                ++i;
-                continue;
-            }
-            int fd = pollFds[i].fd;
-            if (i == 0) {
-                // Check for new connection
-                fd = acceptAndBlock();
-                initRequest(&requests[fd]);
-                requests[fd].conn_fd = fd;
-            }
-            int nextActionId = requests[fd].nextActionId;
-            // if (nextActionId == actionsLen)
-            Result res = actions[nextActionId].handler(&requests[fd]);
-            switch (res) {
-            case SUCCESS:
-                if (++nextActionId == actionsLen) {
-                    cleanUpRequest(&requests[fd]);
-                } else {
-                    requests[fd].nextActionId = nextActionId;
-                    // send next prompt
-                    if (actions[nextActionId].prompt) {
-                        writeStr(fd, actions[nextActionId].prompt);
-                    }
-                }
-                break;
-            case FAILED:
-                writeStr(fd, "Operation failed.\n");
-                cleanUpRequest(&requests[fd]);
-                break;
-            case LOCKED:
-                writeStr(fd, "Locked.\n");
-                cleanUpRequest(&requests[fd]);
-                break;
-            }
-            if (--totalFd == 0)
-                break;
+    while (!stopping) {
+        int timeout = syncTimeout(), commitTimeout = groupTimeout();
+        long timerTimeout = nextTimer(&timers, nowMs());
+        if (commitTimeout >= 0 && (timeout < 0 || commitTimeout < timeout))
+            timeout = commitTimeout;
+        if (timerTimeout >= 0 && (timeout < 0 || timerTimeout < timeout))
+            timeout = (int)timerTimeout;
+        if (acceptMore)
+            timeout = 0;
+        waitEvents(timeout);
+        if (acceptMore) {
+            acceptMore = false;
+            for (int i = 0; i < N_LISTENERS; ++i)
+                if (listeners[i]->conn_fd >= 0)
+                    acceptRequests(listeners[i]);
         }
+        runTimers(&timers, nowMs());
+        if (pendingOrdersLen > 0 && groupTimeout() == 0)
+            flushOrders();
+        if (records && syncPolicy == SYNC_PERIODIC && syncTimeout() == 0)
+            syncRecords();
+        if (compactPid > 0)
+            reapCompaction(false);
+    }
+    flushOrders();
+    if (wal.path)
+        closeLog();
+    if (statsPath)
+        dumpStats();
+    if (records) {
+        syncRecords();
+        munmap(records, recordsSize);
+        records = NULL;
     }
-    free(requests);
+    for (int i = 0; i < slabsLen; ++i)
+        free(slabs[i]);
+    free(slabs);
+    slabs = NULL;
+    freeRequests = NULL;
+#ifdef USE_POLL
     free(pollFds);
-    free(idInfo);
-    free(lockInfo);
-    requests = NULL;
+    free(pollReqs);
     pollFds = NULL;
-    idInfo = NULL;
+    pollReqs = NULL;
+#else
+    free(epollEvents);
+    epollEvents = NULL;
+    if (ring.fd < 0)
+        close(epollFd);
+#endif
+    freeUring(&ring);
+    freeUring(&fileRing);
+    free(lockInfo);
+    free(pendingOrders);
+    free(walBuf);
+    free(logPath);
+    closeFeed(&feed);
+    closeCsieMask(&core);
+    freeInventory(&inventory);
     lockInfo = NULL;
-    close(recordFd);
     return 0;
 }
 
-static int acceptAndBlock() {
+static int acceptAndBlock(Request* from) {
     int conn_fd = 0;
     do {
-        conn_fd = accept(svr.listen_fd, (struct sockaddr*)&cliAddr,
-                         (socklen_t*)&cliLen);
+        cliLen = sizeof(cliAddr);
+        conn_fd = accept4(from->conn_fd, (struct sockaddr*)&cliAddr,
+                          (socklen_t*)&cliLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         // success
         if (conn_fd >= 0)
             break;
         // error
         switch (errno) {
         case EINTR:
-        case EAGAIN:
+        case ECONNABORTED:
             continue;  // try again
+        case EAGAIN:
+            return -1;  // listen_fd is non-blocking, no more pending
+        case EMFILE:
         case ENFILE:
+            if (shedClient(from) == 0)
+                continue;
+            if (errno == EAGAIN)
+                return -1;
+            // wait for a client to leave, the backlog will not be reported
+            // again otherwise
             (void)fprintf(stderr,
                           "out of file descriptor table ... (maxconn %d)\n",
                           maxFd);
+            setAccepting(false);
             return -1;
         default:
             ERR_EXIT("accept");
@@ -229,15 +823,65 @@ static int acceptAndBlock() {
     return conn_fd;
 }
 
-static void initServer(unsigned short port) {
-    struct sockaddr_in servaddr;
-    int tmp;
+// Out of fds: give up the reserved one to accept a client from the backlog
+// and turn it away, instead of leaving it to hang. -1 with errno set if that
+// did not work, EAGAIN when the backlog is empty.
+static int shedClient(Request* from) {
+    if (reserveFd < 0) {
+        errno = EMFILE;
+        return -1;
+    }
+    close(reserveFd);
+    int fd;
+    do {
+        fd = accept4(from->conn_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd < 0 && (errno == EINTR || errno == ECONNABORTED));
+    int err = errno;
+    if (fd >= 0) {
+        if (from == &listener || from == &readListener)
+            (void)write(fd, failedMsg, sizeof(failedMsg) - 1);
+        close(fd);
+        ++metrics.shed;
+    }
+    reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    errno = err;
+    return fd >= 0 ? 0 : -1;
+}
 
+static void initServer(unsigned short port) {
     gethostname(svr.hostname, sizeof(svr.hostname));
     svr.port = port;
+    svr.listen_fd = listenOn(port);
+    svr.bin_fd = svr.binPort ? listenOn(svr.binPort) : -1;
+    svr.admin_fd = svr.adminPort ? listenOn(svr.adminPort) : -1;
+    svr.read_fd = svr.readPort ? listenOn(svr.readPort) : -1;
+
+    // Get file descripter table size, requests are allocated per connection
+    maxFd = getdtablesize();
+    reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    initRequest(&listener);
+    listener.conn_fd = svr.listen_fd;
+    initRequest(&binListener);
+    binListener.conn_fd = svr.bin_fd;
+    initRequest(&adminListener);
+    adminListener.conn_fd = svr.admin_fd;
+    initRequest(&readListener);
+    readListener.conn_fd = svr.read_fd;
+
+    if (!useUring || !initUringPoller())
+        initPoller();
+    for (int i = 0; i < N_LISTENERS; ++i)
+        if (listeners[i]->conn_fd >= 0)
+            appendFd(listeners[i]);
+    return;
+}
 
-    svr.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (svr.listen_fd < 0)
+static int listenOn(unsigned short port) {
+    struct sockaddr_in servaddr;
+    int tmp;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
         ERR_EXIT("socket");
 
     bzero(&servaddr, sizeof(servaddr));
@@ -245,308 +889,2578 @@ static void initServer(unsigned short port) {
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
     tmp = 1;
-    if (setsockopt(svr.listen_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&tmp,
-                   sizeof(tmp)) < 0) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*)&tmp, sizeof(tmp)) <
+        0) {
         ERR_EXIT("setsockopt");
     }
-    if (bind(svr.listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) <
-        0) {
+    // every worker binds its own socket, the kernel balances connections
+    if (nWorkers > 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*)&tmp,
+                                   sizeof(tmp)) < 0) {
+        ERR_EXIT("setsockopt");
+    }
+    if (bind(fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
         ERR_EXIT("bind");
     }
-    if (listen(svr.listen_fd, 1024) < 0) {
+    if (listen(fd, 1024) < 0) {
         ERR_EXIT("listen");
     }
+    setNonBlocking(fd);
+    return fd;
+}
+
+static void forkWorkers() {
+    // Workers inherit core.orders, core.fd (and the mapping of -m), but fcntl
+    // locks belong to a process, so records stay locked across workers.
+    pid_t parent = getpid();
+    pid_t* pids = (pid_t*)malloc(sizeof(pid_t) * nWorkers);
+    if (pids == NULL)
+        ERR_EXIT("out of memory allocating workers");
+    for (int i = 0; i < nWorkers; ++i) {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            ERR_EXIT("fork");
+        if (pids[i] == 0) {
+            // do not outlive the parent if it gets killed
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            if (getppid() != parent)
+                exit(1);
+            free(pids);
+            return;
+        }
+    }
 
-    // Get file descripter table size and initize request table
-    maxFd = getdtablesize();
-    requests = (Request*)malloc(sizeof(Request) * maxFd);
-    if (requests == NULL) {
-        ERR_EXIT("out of memory allocating all requests");
+    int alive = nWorkers;
+    bool signaled = false;
+    while (alive > 0) {
+        if (stopping && !signaled) {
+            for (int i = 0; i < nWorkers; ++i)
+                if (pids[i] > 0)
+                    kill(pids[i], SIGTERM);
+            signaled = true;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR_EXIT("wait");
+        }
+        for (int i = 0; i < nWorkers; ++i)
+            if (pids[i] == pid) {
+                pids[i] = -1;
+                --alive;
+                fprintf(stderr, "worker %d exited with status %d\n", pid,
+                        status);
+            }
     }
-    for (int i = 0; i < maxFd; i++) {
-        initRequest(&requests[i]);
+    free(pids);
+    exit(0);
+}
+
+static void setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        ERR_EXIT("fcntl");
+}
+
+#ifdef USE_POLL
+static void initPoller() {
+    pollFds = NULL;
+    pollReqs = NULL;
+    pollFdsLen = pollFdsCap = 0;
+}
+
+static int waitEvents(int timeout) {
+    if (ring.fd >= 0)
+        return waitUring(timeout);
+#ifndef NDEBUG
+    fprintf(stderr, "Now polling: (");
+    for (int i = 0; i < pollFdsLen; ++i) {
+        fprintf(stderr, "%d, ", pollFds[i].fd);
     }
-    requests[svr.listen_fd].conn_fd = svr.listen_fd;
-    strcpy(requests[svr.listen_fd].host, svr.hostname);
+    fprintf(stderr, ")\n");
+    fprintf(stderr, "<<< start polling ......");
+#endif
+    int totalFd = poll(pollFds, pollFdsLen, timeout);
+#ifndef NDEBUG
+    fprintf(stderr, "end polling, %d ready >>>\n", totalFd);
+#endif
+    if (totalFd < 0) {
+        if (errno == EINTR)
+            return 0;
+        ERR_EXIT("poll");
+    }
+    ++metrics.wakeups;
+    metrics.events += totalFd;
+    // Walk backwards: removeFd() moves the last entry into the hole, which
+    // has already been visited, and appendFd() adds entries not yet ready.
+    for (int i = pollFdsLen - 1, left = totalFd; i >= 0 && left > 0; --i) {
+        if (pollFds[i].revents == 0)
+            continue;
+        pollFds[i].revents = 0;
+        --left;
+        Request* req = pollReqs[i];
+        if (isListener(req))
+            acceptRequests(req);
+        else
+            serveRequest(req);
+    }
+    return totalFd;
+}
 
-    pollFds = (struct pollfd*)malloc(sizeof(struct pollfd) * maxFd);
-    pollFdsLen = 0;
-    appendFd(svr.listen_fd);
-    return;
+static void updateEvents(Request* req) {
+    // level-triggered: only ask for what the request can handle now
+    if (req->pollIdx < 0)
+        return;
+    bool wantInput = !req->closing && !req->pending && hasOutputRoom(req);
+    pollFds[req->pollIdx].events =
+        (wantInput ? POLLIN : 0) | (req->outLen ? POLLOUT : 0);
+}
+
+static void setAccepting(bool accepting) {
+    if (ring.fd >= 0) {
+        setUringAccepting(accepting);
+        return;
+    }
+    acceptPaused = !accepting;
+    for (int i = 0; i < N_LISTENERS; ++i)
+        if (listeners[i]->pollIdx >= 0 && listeners[i] != &adminListener)
+            pollFds[listeners[i]->pollIdx].events = accepting ? POLLIN : 0;
 }
 
-static void appendFd(int fd) {
-    // assume 0 <= fds_len < maxfds;
-    pollFds[pollFdsLen].fd = fd;
+static void appendFd(Request* req) {
+    if (ring.fd >= 0) {
+        appendUringFd(req);
+        return;
+    }
+    if (pollFdsLen == pollFdsCap) {
+        // grows with the connections, not with the fd limit
+        int cap = pollFdsCap ? pollFdsCap * 2 : 64;
+        struct pollfd* fds =
+            (struct pollfd*)realloc(pollFds, sizeof(struct pollfd) * cap);
+        if (fds == NULL)
+            ERR_EXIT("out of memory allocating pollFds");
+        pollFds = fds;
+        Request** reqs = (Request**)realloc(pollReqs, sizeof(Request*) * cap);
+        if (reqs == NULL)
+            ERR_EXIT("out of memory allocating pollFds");
+        pollReqs = reqs;
+        pollFdsCap = cap;
+    }
+    pollFds[pollFdsLen].fd = req->conn_fd;
     pollFds[pollFdsLen].events = POLLIN;  // can be read
     pollFds[pollFdsLen].revents = 0;
+    pollReqs[pollFdsLen] = req;
+    req->pollIdx = pollFdsLen;
     ++pollFdsLen;
 }
 
-static void removeFd(int fd) {
-    // assume 0 <= pollFdsLen < maxFds;
-    int idx = 0;
-    for (; idx < pollFdsLen; ++idx) {
-        if (pollFds[idx].fd == fd)
-            break;
+static void removeFd(Request* req) {
+    if (ring.fd >= 0) {
+        removeUringFd(req);
+        return;
     }
-    if (idx == pollFdsLen)
-        // Not found
+    int idx = req->pollIdx;
+    if (idx < 0)
+        // Not polled
         return;
 
     if (idx != pollFdsLen - 1) {
-        // move pollFdsLen[-1] to pollFdsLen[idx]
+        // move pollFds[-1] to pollFds[idx]
         memcpy(pollFds + idx, pollFds + pollFdsLen - 1, sizeof(struct pollfd));
+        pollReqs[idx] = pollReqs[pollFdsLen - 1];
+        pollReqs[idx]->pollIdx = idx;
     }
+    req->pollIdx = -1;
     --pollFdsLen;
 }
-
-static void initRequest(Request* req) {
-    req->conn_fd = -1;
-    req->buf_len = 0;
-    req->id = -1;
-    req->nextActionId = 0;
+#else
+static void initPoller() {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0)
+        ERR_EXIT("epoll_create1");
+    epollEvents =
+        (struct epoll_event*)malloc(sizeof(struct epoll_event) * EVENT_BATCH);
+    if (epollEvents == NULL)
+        ERR_EXIT("out of memory allocating epollEvents");
 }
 
-static void cleanUpRequest(Request* req) {
+static int waitEvents(int timeout) {
+    if (ring.fd >= 0)
+        return waitUring(timeout);
+    int totalFd = epoll_wait(epollFd, epollEvents, EVENT_BATCH, timeout);
 #ifndef NDEBUG
-    fprintf(stderr, "close %d\n", req->conn_fd);
+    fprintf(stderr, "epoll_wait, %d ready\n", totalFd);
 #endif
-    close(req->conn_fd);     // close connection
-    removeFd(req->conn_fd);  // remove from pollFds
-    initRequest(req);        // reset req
+    if (totalFd < 0) {
+        if (errno == EINTR)
+            return 0;
+        ERR_EXIT("epoll_wait");
+    }
+    ++metrics.wakeups;
+    metrics.events += totalFd;
+    for (int i = 0; i < totalFd; ++i) {
+        Request* req = (Request*)epollEvents[i].data.ptr;
+        if (req->conn_fd < 0)
+            // closed by an earlier event in this batch, a request reused by
+            // a later accept only gets a spurious wake-up
+            continue;
+        if (isListener(req))
+            acceptRequests(req);
+        else
+            serveRequest(req);
+    }
+    return totalFd;
 }
 
-static int readRequest(Request* req) {
-    static char buf[512];
-    req->buf_len = 512;
-    int nRead = read(req->conn_fd, buf, sizeof(buf));
-    if (nRead < 512) {
-        buf[nRead] = '\0';
-        req->buf_len = nRead;
-    }
-    strncpy(req->buf, buf, 512);
-#ifndef NDEBUG
-    fprintf(stderr, "received raw: '");
-    for (char *c = req->buf, *end = req->buf + req->buf_len; *c && c != end;
-         ++c) {
-        if (isprint(*c))
-            fputc(*c, stderr);
-        else
-            switch (*c) {
-            case '\n':
-                fprintf(stderr, "\\n");
-                break;
-            case '\r':
-                fprintf(stderr, "\\r");
-                break;
-            default:
-                fprintf(stderr, "\\x%02x", *c);
-                break;
-            }
+static void updateEvents(Request* req) {
+    (void)req;  // edge-triggered, reported on every change
+}
+
+static void setAccepting(bool accepting) {
+    if (ring.fd >= 0) {
+        setUringAccepting(accepting);
+        return;
+    }
+    acceptPaused = !accepting;
+    // EPOLL_CTL_MOD re-arms the edge, a waiting backlog is reported again
+    for (int i = 0; i < N_LISTENERS; ++i) {
+        if (listeners[i]->conn_fd < 0 || listeners[i] == &adminListener)
+            continue;
+        struct epoll_event ev = {.events = accepting ? EPOLLIN | EPOLLET : 0,
+                                 .data.ptr = listeners[i]};
+        if (epoll_ctl(epollFd, EPOLL_CTL_MOD, listeners[i]->conn_fd, &ev) < 0)
+            ERR_EXIT("epoll_ctl");
     }
-    fprintf(stderr, "', from fd %d, buf_len is %ld\n", req->conn_fd,
-            req->buf_len);
-#endif
-    return nRead;
 }
 
-static Result startRequest(Request* req) {
-    strcpy(req->host, inet_ntoa(cliAddr.sin_addr));
-    appendFd(req->conn_fd);  // add to pollFds
-#ifndef NDEBUG
-    fprintf(stderr, "getting a new request... fd %d from %s\n", req->conn_fd,
-            req->host);
-#endif
-    return SUCCESS;
+static void appendFd(Request* req) {
+    if (ring.fd >= 0) {
+        appendUringFd(req);
+        return;
+    }
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = req};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, req->conn_fd, &ev) < 0)
+        ERR_EXIT("epoll_ctl");
 }
 
-static Result lookUpRecord(Request* req) {
-    if (readRequest(req) <= 0) {
-        // 0: disconnect
-        // -1: error
-        return FAILED;
+static void removeFd(Request* req) {
+    if (ring.fd >= 0) {
+        removeUringFd(req);
+        return;
     }
-    // Error: resource temporarily unavailable
-    char* firstInvalid;
-    errno = 0;
-    int id = strtol(req->buf, &firstInvalid, 10);
-    if (req->buf == firstInvalid || errno != 0) {
-#ifndef NDEBUG
-        fprintf(stderr, "invalid number, '%s'\n", req->buf);
+    // close() would drop it as well, unless the fd has been dup()ed
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, req->conn_fd, NULL);
+}
 #endif
-        return FAILED;
+
+static bool initUringPoller() {
+    if (initUring(&ring, URING_ENTRIES,
+                  IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) <
+        0) {
+        fprintf(stderr, "no io_uring (%s), polling instead\n",
+                strerror(errno));
+        return false;
+    }
+    // both tables start empty, filled as clients connect and slabs are carved
+    int nFiles = maxFd < (1 << 20) ? maxFd : 1 << 20;
+    struct io_uring_rsrc_register files = {
+        .nr = nFiles, .flags = IORING_RSRC_REGISTER_SPARSE};
+    fixedFiles = registerUring(&ring, IORING_REGISTER_FILES2, &files,
+                               sizeof(files)) == 0
+                     ? nFiles
+                     : 0;
+    bufferSlots = maxFd / REQUESTS_PER_SLAB + 1;
+    if (bufferSlots > (1 << 14))
+        bufferSlots = 1 << 14;
+    struct io_uring_rsrc_register buffers = {
+        .nr = bufferSlots, .flags = IORING_RSRC_REGISTER_SPARSE};
+    if (registerUring(&ring, IORING_REGISTER_BUFFERS2, &buffers,
+                      sizeof(buffers)) < 0)
+        bufferSlots = 0;
+    fixedSlabs = 0;
+    return true;
+}
+
+static int waitUring(int timeout) {
+    if (submitUring(&ring, 1, timeout) < 0)
+        ERR_EXIT("io_uring_enter");
+    ++metrics.wakeups;
+    int total = 0;
+    struct io_uring_cqe* cqe;
+    while ((cqe = peekCqe(&ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        seenCqe(&ring);
+        ++total;
+        Request* req = (Request*)(uintptr_t)(data & ~(uint64_t)URING_OPS);
+        switch (data & URING_OPS) {
+        case URING_POLL:
+            if (!(flags & IORING_CQE_F_MORE)) {
+                // removed by setAccepting(false), or gave up
+                req->recvBusy = false;
+                if (!acceptPaused || req == &adminListener)
+                    armListener(req);
+            }
+            if (res > 0 && (!acceptPaused || req == &adminListener))
+                acceptRequests(req);
+            continue;
+        case URING_RECV:
+            req->recvBusy = false;
+            req->staged = res > 0 ? res : res == 0 ? -1 : -2;
+            break;
+        case URING_SEND:
+            req->sendBusy = false;
+            if (req->conn_fd < 0)
+                break;
+            if (res < 0) {
+                req->outHead = req->outLen = 0;
+                req->outTextLen = 0;
+                req->closing = true;
+            } else {
+                dropOutput(req, res);
+            }
+            break;
+        default:
+            continue;  // a fixed file update or a cancellation
+        }
+        if (req->conn_fd >= 0)
+            serveRequest(req);
+        else if (!req->recvBusy && !req->sendBusy)
+            releaseRequest(req);  // closed while this was in flight
     }
 #ifndef NDEBUG
-    fprintf(stderr, "id is %d\n", id);
+    fprintf(stderr, "io_uring_enter, %d completed\n", total);
 #endif
+    metrics.events += total;
+    return total;
+}
 
-    req->id = id;
-    int idx = getIndexOfId(id);
-    if (idx < 0)
-        // ID not found
-        return FAILED;
+static struct io_uring_sqe* takeSqe(Uring* uring) {
+    struct io_uring_sqe* sqe = getSqe(uring);
+    if (sqe == NULL)
+        ERR_EXIT("io_uring_enter");
+    return sqe;
+}
 
-    if (tryAcquireReadLock(req, idx) < 0)
-        return LOCKED;
+// a client's fd is its slot in the fixed files
+static void setSqeFd(struct io_uring_sqe* sqe, int fd) {
+    sqe->fd = fd;
+    if (fd < fixedFiles)
+        sqe->flags |= IOSQE_FIXED_FILE;
+}
 
-    lseek(recordFd, idx * sizeof(Order), SEEK_SET);
-    if (safeRead(recordFd, (char*)&orderBuf, sizeof(Order)) < 0) {
-        releaseLock(req, idx);
-        return FAILED;
+// a multishot poll, one completion per wake-up until it is removed
+static void armListener(Request* req) {
+    struct io_uring_sqe* sqe = takeSqe(&ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = req->conn_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = (uintptr_t)req | URING_POLL;
+    req->recvBusy = true;
+}
+
+static void appendUringFd(Request* req) {
+    if (isListener(req)) {
+        armListener(req);
+        return;
     }
+    if (req->conn_fd >= fixedFiles)
+        return;
+    // Operations are issued in order, the ones queued after this already
+    // find the file in its slot. The fd is read when this is submitted: if
+    // the client is gone by then the slot stays empty.
+    struct io_uring_sqe* sqe = takeSqe(&ring);
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&req->conn_fd;
+    sqe->len = 1;
+    sqe->off = req->conn_fd;
+}
 
-    if (releaseLock(req, idx) < 0)
-        return FAILED;
+static void removeUringFd(Request* req) {
+    static const int noFd = -1;
+    if (req->recvBusy || req->sendBusy) {
+        // an fd that is not fixed is looked up on submission, it has to be
+        // before close() lets the next client have it
+        if (req->conn_fd >= fixedFiles && submitUring(&ring, 0, 0) < 0)
+            ERR_EXIT("io_uring_enter");
+        for (int op = URING_RECV; op <= URING_SEND; ++op) {
+            if (!(op == URING_RECV ? req->recvBusy : req->sendBusy))
+                continue;
+            struct io_uring_sqe* sqe = takeSqe(&ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uintptr_t)req | op;
+        }
+    }
+    if (req->conn_fd >= fixedFiles)
+        return;
+    // the slot holds the socket open until it is emptied
+    struct io_uring_sqe* sqe = takeSqe(&ring);
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&noFd;
+    sqe->len = 1;
+    sqe->off = req->conn_fd;
+}
 
-#ifndef READ_SERVER
-    if (tryAcquireWriteLock(req, idx) < 0)
-        return LOCKED;
-#endif
-    idInfo[idx] = orderBuf;  // The record is not locked now
+static void setUringAccepting(bool accepting) {
+    acceptPaused = !accepting;
+    for (int i = 0; i < N_LISTENERS; ++i) {
+        Request* req = listeners[i];
+        if (req->conn_fd < 0 || req == &adminListener)
+            continue;
+        if (accepting && !req->recvBusy) {
+            armListener(req);
+        } else if (!accepting && req->recvBusy) {
+            // its last completion comes without IORING_CQE_F_MORE
+            struct io_uring_sqe* sqe = takeSqe(&ring);
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = (uintptr_t)req | URING_POLL;
+        }
+    }
+}
 
-    sprintf(buf, "You can order %d adult mask(s) and %d children mask(s).\n",
-            idInfo[idx].adultMask, idInfo[idx].childrenMask);
-    write(req->conn_fd, buf, strlen(buf));
-    return SUCCESS;
+// Make the staging areas of a new slab a registered buffer. Slabs are
+// registered in order and the first that cannot be ends it, those after
+// read into unregistered memory.
+static void registerSlab(int slabIdx) {
+    if (slabIdx != fixedSlabs || slabIdx >= bufferSlots)
+        return;
+    struct iovec iov = {.iov_base = slabs[slabIdx] + REQUESTS_PER_SLAB,
+                        .iov_len = STAGE_SIZE * REQUESTS_PER_SLAB};
+    struct io_uring_rsrc_update2 update = {
+        .offset = slabIdx, .data = (uintptr_t)&iov, .nr = 1};
+    if (registerUring(&ring, IORING_REGISTER_BUFFERS_UPDATE, &update,
+                      sizeof(update)) >= 0)
+        ++fixedSlabs;
 }
 
-static Result handleOrder(Request* req) {
-    int idx = getIndexOfId(req->id);
-    if (idx < 0)
-        // ID not found
-        return FAILED;
+static char* stageOf(Request* req) {
+    Request* slab = slabs[req->slab];
+    return (char*)(slab + REQUESTS_PER_SLAB) + (req - slab) * STAGE_SIZE;
+}
 
-    if (readRequest(req) <= 0) {
-        // 0: disconnect
-        // -1: error
-        releaseLock(req, idx);
-        return FAILED;
+// read() from the client. With -U the data comes out of the staging area,
+// and a read is submitted to fill it once it runs dry: EAGAIN until then.
+static ssize_t receive(Request* req, char* buf, size_t room) {
+    if (ring.fd < 0)
+        return read(req->conn_fd, buf, room);
+    if (req->staged == 0 && !req->recvBusy) {
+        struct io_uring_sqe* sqe = takeSqe(&ring);
+        sqe->opcode =
+            req->slab < fixedSlabs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        setSqeFd(sqe, req->conn_fd);
+        sqe->addr = (uintptr_t)stageOf(req);
+        sqe->len = STAGE_SIZE;
+        sqe->buf_index = req->slab;
+        sqe->user_data = (uintptr_t)req | URING_RECV;
+        req->recvBusy = true;
     }
-
-    int orderChild = 0;
-    int orderAdult = 0;
-    int nRead = 0;
-    if (sscanf(req->buf, "adult %d%n", &orderAdult, &nRead) != 1 &&
-        sscanf(req->buf, "children %d%n", &orderChild, &nRead) != 1) {
-        // no valid command
-        releaseLock(req, idx);
-        return FAILED;
+    if (req->staged <= 0) {
+        if (req->staged == -1)
+            return 0;
+        errno = req->staged == 0 ? EAGAIN : ECONNRESET;
+        return -1;
     }
+    size_t n = room < (size_t)req->staged ? room : (size_t)req->staged;
+    char* stage = stageOf(req);
+    memcpy(buf, stage, n);
+    memmove(stage, stage + n, req->staged - n);
+    req->staged -= n;
+    return n;
+}
 
-    for (int i = req->buf_len - 1; i >= nRead; --i)
+// -U: writev() the queue, the completion drops what was written. The
+// iovecs are copied on submission, what is queued after waits for the next.
+static void sendOutput(Request* req) {
+    struct io_uring_sqe* sqe = takeSqe(&ring);
+    sqe->opcode = IORING_OP_WRITEV;
+    setSqeFd(sqe, req->conn_fd);
+    sqe->addr = (uintptr_t)&req->out[req->outHead];
+    sqe->len = req->outLen;
+    sqe->user_data = (uintptr_t)req | URING_SEND;
+    req->sendBusy = true;
+}
+
+static void initRequest(Request* req) {
+    req->conn_fd = -1;
+    req->buf_len = 0;
+    req->line_len = 0;
+    req->lineDue = false;
+    req->skipLine = false;
+    req->closing = false;
+    req->binary = false;
+    req->admin = false;
+    req->reader = false;
+    req->recvBusy = req->sendBusy = false;
+    req->staged = 0;
+    req->outHead = req->outLen = 0;
+    req->outText = req->outInline;
+    req->outTextCap = sizeof(req->outInline);
+    req->outTextLen = 0;
+    initTimer(&req->graceTimer, onGraceTimer);
+    initTimer(&req->stateTimer, onStateTimer);
+    initTimer(&req->lockTimer, onLockTimer);
+    req->id = -1;
+    req->nextActionId = 0;
+    req->pending = false;
+    req->bulk = NULL;
+#ifdef USE_POLL
+    req->pollIdx = -1;
+#endif
+}
+
+static void cleanUpRequest(Request* req) {
+#ifndef NDEBUG
+    fprintf(stderr, "close %d\n", req->conn_fd);
+#endif
+    releaseHeldLock(req);
+    if (req->admin)
+        --nAdminConns;
+    delTimer(&timers, &req->graceTimer);
+    delTimer(&timers, &req->stateTimer);
+    delTimer(&timers, &req->lockTimer);
+    removeFd(req);        // remove from pollFds
+    close(req->conn_fd);  // close connection
+    req->conn_fd = -1;
+    // -U: what a submitted operation uses stays until it completes
+    if (!req->recvBusy && !req->sendBusy)
+        releaseRequest(req);
+    --nConns;
+    if (acceptPaused && (maxConns == 0 || nConns - nAdminConns < maxConns)) {
+        setAccepting(true);
+        acceptMore = true;  // poll() does not report a waiting backlog at once
+    }
+}
+
+static Request* allocRequest() {
+    if (freeRequests == NULL) {
+        if (slabsLen == slabsCap) {
+            int cap = slabsCap ? slabsCap * 2 : 16;
+            Request** grown = (Request**)realloc(slabs, sizeof(Request*) * cap);
+            if (grown == NULL)
+                return NULL;
+            slabs = grown;
+            slabsCap = cap;
+        }
+        // -U: the staging areas of the requests follow them
+        Request* slab = (Request*)aligned_alloc(
+            CACHE_LINE, (sizeof(Request) + (ring.fd >= 0 ? STAGE_SIZE : 0)) *
+                            REQUESTS_PER_SLAB);
+        if (slab == NULL)
+            return NULL;
+        slabs[slabsLen++] = slab;
+        if (ring.fd >= 0)
+            registerSlab(slabsLen - 1);
+        for (int i = REQUESTS_PER_SLAB - 1; i >= 0; --i) {
+            slab[i].slab = slabsLen - 1;
+            slab[i].nextFree = freeRequests;
+            freeRequests = &slab[i];
+        }
+    }
+    Request* req = freeRequests;
+    freeRequests = req->nextFree;
+    initRequest(req);
+    return req;
+}
+
+// free what a closed request holds and recycle it
+static void releaseRequest(Request* req) {
+    if (req->outText != req->outInline)
+        free(req->outText);
+    freeBulk(req);
+    freeRequest(req);  // reset req
+}
+
+static void freeRequest(Request* req) {
+    initRequest(req);
+    req->nextFree = freeRequests;
+    freeRequests = req;
+}
+
+// a client that leaves halfway through an order gives up the record
+static void releaseHeldLock(Request* req) {
+    int idx = req->id >= 0 ? getIndexOfId(req->id) : -1;
+    if (idx >= 0 && lockInfo[idx].owner == req)
+        releaseLock(req, idx);
+}
+
+static bool isListener(Request* req) {
+    return req == &listener || req == &binListener ||
+           req == &adminListener || req == &readListener;
+}
+
+static void acceptRequests(Request* from) {
+    // Drain the backlog, listen_fd is edge-triggered. When the budget runs
+    // out first, main() calls again without waiting for another edge.
+    for (int budget = ACCEPT_BUDGET; budget > 0; --budget) {
+        if (maxConns && nConns - nAdminConns >= maxConns &&
+            from != &adminListener) {
+            // leave the rest in the backlog until a client leaves
+            setAccepting(false);
+            return;
+        }
+        int fd = acceptAndBlock(from);
+        if (fd < 0)
+            return;
+        // replies and prompts are separate writes, do not let Nagle hold
+        // back the second one for a delayed ACK
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        Request* req = allocRequest();
+        if (req == NULL) {
+            fprintf(stderr, "out of memory allocating a request\n");
+            close(fd);
+            continue;
+        }
+        req->conn_fd = fd;
+        req->reader = from == &readListener;
+        if (from == &binListener || from == &adminListener) {
+            // room for the replies to a few pipelined batches, or for stats
+            req->binary = from == &binListener;
+            req->admin = from == &adminListener;
+            req->outTextCap = 2 * (req->binary ? BIN_REPLY_MAX : STATS_MAX);
+            req->outText = (char*)malloc(req->outTextCap);
+            if (req->outText == NULL) {
+                fprintf(stderr, "out of memory allocating a request\n");
+                req->outText = req->outInline;
+                close(fd);
+                freeRequest(req);
+                continue;
+            }
+        }
+        ++nConns;
+        nAdminConns += req->admin;
+        ++metrics.accepted;
+        serveRequest(req);
+    }
+    acceptMore = true;
+}
+
+static void serveRequest(Request* req) {
+    if (req->outLen && flushOutput(req) < 0)
+        req->closing = true;
+    if (req->closing) {
+        if (req->outLen == 0 && !req->pending)
+            cleanUpRequest(req);
+        else
+            updateEvents(req);
+        return;
+    }
+    // Keep going until the handler runs out of input, an edge-triggered fd
+    // will not be reported again for data that is already buffered.
+    while (!req->pending) {
+        if (!hasOutputRoom(req) && (flushOutput(req) < 0 || !hasOutputRoom(req)))
+            break;  // the client is not reading, wait for POLLOUT
+        HandlerKind kind = !req->nextActionId ? H_START
+                           : req->binary      ? H_BINARY
+                           : req->admin       ? H_ADMIN
+                           : req->bulk        ? H_BULK
+                                              : (HandlerKind)req->nextActionId;
+        uint64_t start = startSample();
+        Result res = kind == H_BINARY ? handleBinary(req)
+                     : kind == H_ADMIN ? handleAdmin(req)
+                     : kind == H_BULK  ? handleBulk(req)
+                                       : actions[req->nextActionId].handler(req);
+        if (kind == H_LOOKUP && req->bulk)
+            kind = H_BULK;  // "bulk" at the id prompt, answered at once
+        if (res != AGAIN) {
+            ++metrics.handled[kind];
+            if (start)
+                recordHistogram(&metrics.handlers[kind], nowNs() - start);
+        }
+        if (res == AGAIN || res == PENDING || !finishAction(req, res))
+            break;
+    }
+    if (req->conn_fd < 0)
+        return;  // closed
+    // the reply and the next prompt go out in one writev()
+    if (flushOutput(req) < 0) {
+        closeRequest(req);
+        return;
+    }
+    updateEvents(req);
+}
+
+// close after the queued output is written
+static void closeRequest(Request* req) {
+    req->closing = true;
+    if (flushOutput(req) < 0 || req->outLen == 0) {
+        if (!req->pending)
+            cleanUpRequest(req);
+        return;
+    }
+    updateEvents(req);
+}
+
+// move to the next action, false if the request is closed
+static bool finishAction(Request* req, Result res) {
+    if (req->binary || req->admin) {
+        // every request has been answered, there are no prompts
+        switch (res) {
+        case SUCCESS:
+            req->nextActionId = 1;
+            if (idTimeout)
+                armTimer(&req->stateTimer, idTimeout);
+            return true;
+        case FAILED:  // malformed request
+            closeRequest(req);
+            return false;
+        case CLOSED:
+            cleanUpRequest(req);
+            return false;
+        default:
+            return true;
+        }
+    }
+    int nextActionId = req->nextActionId + 1;
+    switch (res) {
+    case SUCCESS:
+        // a reader is done after the lookup, as with read_server
+        if (nextActionId < (req->reader ? H_ORDER : actionsLen))
+            break;
+        if (!keepAlive) {
+            closeRequest(req);
+            return false;
+        }
+        nextActionId = 1;  // skip startRequest, ask for the next id
+        break;
+    case FAILED:
+    case LOCKED:
+        queueStr(req, res == FAILED ? failedMsg : lockedMsg);
+        if (!keepAlive) {
+            closeRequest(req);
+            return false;
+        }
+        nextActionId = 1;
+        break;
+    case CLOSED:
+        cleanUpRequest(req);
+        return false;
+    default:
+        return true;
+    }
+    req->nextActionId = nextActionId;
+    if (actions[nextActionId].timeout && *actions[nextActionId].timeout)
+        armTimer(&req->stateTimer, *actions[nextActionId].timeout);
+    else
+        delTimer(&timers, &req->stateTimer);
+    // send next prompt
+    if (actions[nextActionId].prompt) {
+        queueStr(req, actions[nextActionId].prompt);
+    }
+    return true;
+}
+
+// queue a string that outlives the request, it is not copied
+static void queueStr(Request* req, const char* str) {
+    if (req->outHead + req->outLen == OUT_SEGMENTS)
+        return;  // hasOutputRoom() keeps this from happening
+    struct iovec* iov = &req->out[req->outHead + req->outLen++];
+    iov->iov_base = (void*)str;
+    iov->iov_len = strlen(str);
+}
+
+static void queueText(Request* req, const char* fmt, ...) {
+    size_t room = req->outTextCap - req->outTextLen;
+    if (req->outHead + req->outLen == OUT_SEGMENTS || room == 0)
+        return;
+    char* text = req->outText + req->outTextLen;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(text, room, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if ((size_t)len >= room)
+        len = room - 1;
+    req->outTextLen += len;
+    struct iovec* iov = &req->out[req->outHead + req->outLen++];
+    iov->iov_base = text;
+    iov->iov_len = len;
+}
+
+// copy data into outText, appending to the last segment if it ends there
+static void queueBytes(Request* req, const void* data, size_t len) {
+    if (req->outTextLen + len > req->outTextCap)
+        return;  // hasOutputRoom() keeps this from happening
+    char* text = req->outText + req->outTextLen;
+    memcpy(text, data, len);
+    req->outTextLen += len;
+    struct iovec* last =
+        req->outLen ? &req->out[req->outHead + req->outLen - 1] : NULL;
+    if (last && (char*)last->iov_base + last->iov_len == text) {
+        last->iov_len += len;
+        return;
+    }
+    if (req->outHead + req->outLen == OUT_SEGMENTS)
+        return;
+    struct iovec* iov = &req->out[req->outHead + req->outLen++];
+    iov->iov_base = text;
+    iov->iov_len = len;
+}
+
+// enough space to queue one more command's reply and prompts
+static bool hasOutputRoom(Request* req) {
+    if (req->bulk && req->bulk->reply)
+        return false;  // wait for the whole bulk reply to go out
+    return req->outHead + req->outLen + 3 <= OUT_SEGMENTS &&
+           req->outTextLen + (req->binary  ? BIN_REPLY_MAX
+                              : req->admin ? STATS_MAX
+                                           : REPLY_MAX) <=
+               req->outTextCap;
+}
+
+// write as much of the queue as the socket takes, -1 if the client is gone
+static int flushOutput(Request* req) {
+    while (req->outLen && ring.fd < 0) {
+        ssize_t n = writev(req->conn_fd, &req->out[req->outHead], req->outLen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            req->outHead = req->outLen = 0;
+            req->outTextLen = 0;
+            return -1;
+        }
+        dropOutput(req, n);
+    }
+    if (req->outLen && !req->sendBusy)
+        sendOutput(req);  // -U: dropOutput() once it completes
+    else if (req->outLen == 0)
+        dropOutput(req, 0);
+    return 0;
+}
+
+// drop n bytes that have been written, reset the queue once it is empty
+static void dropOutput(Request* req, size_t n) {
+    metrics.bytesOut += n;
+    while (req->outLen && n >= req->out[req->outHead].iov_len) {
+        n -= req->out[req->outHead].iov_len;
+        ++req->outHead;
+        --req->outLen;
+    }
+    if (req->outLen) {
+        req->out[req->outHead].iov_base =
+            (char*)req->out[req->outHead].iov_base + n;
+        req->out[req->outHead].iov_len -= n;
+        return;
+    }
+    req->outHead = 0;
+    req->outTextLen = 0;
+    if (req->bulk && req->bulk->reply)
+        freeBulk(req);
+}
+
+// Frame the next line in req->buf, reading as much as is needed.
+// Returns the bytes taken by the line (terminator included), 0 if the client
+// closed without sending anything, -1 on error: errno is EAGAIN while the
+// line is incomplete and EMSGSIZE if it does not fit in req->buf.
+static int readRequest(Request* req) {
+    // drop the previous line, keep what was pipelined after it
+    if (req->line_len) {
+        req->buf_len -= req->line_len;
+        memmove(req->buf, req->buf + req->line_len, req->buf_len);
+        req->line_len = 0;
+    }
+    size_t scanned = 0;
+    while (1) {
+        char* eol = memchr(req->buf + scanned, '\n', req->buf_len - scanned);
+        if (req->skipLine) {
+            // resynchronize after an oversize line
+            size_t drop = eol ? (size_t)(eol - req->buf + 1) : req->buf_len;
+            req->buf_len -= drop;
+            memmove(req->buf, req->buf + drop, req->buf_len);
+            req->skipLine = eol == NULL;
+            scanned = 0;
+            if (eol)
+                continue;
+        } else if (eol) {
+            *eol = '\0';
+            req->line_len = eol - req->buf + 1;
+            break;
+        }
+        scanned = req->buf_len;
+        if (req->lineDue && req->buf_len) {
+            // the client stopped without a newline
+            req->buf[req->buf_len] = '\0';
+            req->line_len = req->buf_len;
+            break;
+        }
+        if (req->buf_len == sizeof(req->buf) - 1) {
+            delTimer(&timers, &req->graceTimer);
+            req->buf_len = 0;
+            req->skipLine = true;
+            errno = EMSGSIZE;
+            return -1;
+        }
+        int nRead = receive(req, req->buf + req->buf_len,
+                            sizeof(req->buf) - 1 - req->buf_len);
+        if (nRead > 0) {
+            req->buf_len += nRead;
+            metrics.bytesIn += nRead;
+            continue;
+        }
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        if (nRead < 0 && errno == EAGAIN && req->buf_len && !req->skipLine &&
+            lineGraceMs)
+            armTimer(&req->graceTimer, lineGraceMs);  // restarts it
+        if (nRead < 0 || req->buf_len == 0)
+            return nRead;
+        // EOF after a partial line
+        req->buf[req->buf_len] = '\0';
+        req->line_len = req->buf_len;
+        break;
+    }
+    delTimer(&timers, &req->graceTimer);
+    req->lineDue = false;
+#ifndef NDEBUG
+    fprintf(stderr, "received line: '");
+    for (char* c = req->buf; *c; ++c) {
+        if (isprint(*c))
+            fputc(*c, stderr);
+        else
+            switch (*c) {
+            case '\r':
+                fprintf(stderr, "\\r");
+                break;
+            default:
+                fprintf(stderr, "\\x%02x", *c);
+                break;
+            }
+    }
+    fprintf(stderr, "', from fd %d, %ld byte(s) buffered\n", req->conn_fd,
+            req->buf_len);
+#endif
+    return req->line_len;
+}
+
+static long nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void armTimer(Timer* timer, int ms) {
+    addTimer(&timers, timer, nowMs(), ms);
+}
+
+// the client stopped halfway through a line, hand it to the handler
+static void onGraceTimer(Timer* timer) {
+    Request* req = REQUEST_OF(timer, graceTimer);
+    req->lineDue = true;
+    serveRequest(req);
+}
+
+// Drop a client that did not send its command in time, or that did not read
+// its replies before closing. A pending order is left to flushOrders().
+static void onStateTimer(Timer* timer) {
+    Request* req = REQUEST_OF(timer, stateTimer);
+    if (req->pending)
+        return;
+#ifndef NDEBUG
+    fprintf(stderr, "fd %d timed out\n", req->conn_fd);
+#endif
+    ++metrics.timedOut;
+    if (req->closing) {
+        cleanUpRequest(req);
+        return;
+    }
+    releaseHeldLock(req);
+    if (!req->binary && req->outHead + req->outLen < OUT_SEGMENTS)
+        queueStr(req, failedMsg);
+    closeRequest(req);
+    // a client that does not read gets until the next deadline
+    if (req->conn_fd >= 0 && idTimeout)
+        armTimer(&req->stateTimer, idTimeout);
+}
+
+static void onLockTimer(Timer* timer) {
+    Request* req = REQUEST_OF(timer, lockTimer);
+    if (req->pending)
+        return;
+#ifndef NDEBUG
+    fprintf(stderr, "fd %d held its lock too long\n", req->conn_fd);
+#endif
+    onStateTimer(&req->stateTimer);
+}
+
+static Result startRequest(Request* req) {
+    req->addr = cliAddr.sin_addr;
+    appendFd(req);  // add to pollFds
+#ifndef NDEBUG
+    fprintf(stderr, "getting a new request... fd %d from %s\n", req->conn_fd,
+            inet_ntoa(req->addr));
+#endif
+    return SUCCESS;
+}
+
+static Result lookUpRecord(Request* req) {
+    int nRead = readRequest(req);
+    if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return AGAIN;
+    if (nRead == 0 && keepAlive)
+        return CLOSED;
+    if (nRead <= 0) {
+        // 0: disconnect
+        // -1: error
+        return FAILED;
+    }
+    if (strncmp(req->buf, "bulk", 4) == 0 &&
+        (req->buf[4] == '\0' || isspace(req->buf[4])))
+        return startBulk(req);
+    // Error: resource temporarily unavailable
+    char* firstInvalid;
+    errno = 0;
+    int id = strtol(req->buf, &firstInvalid, 10);
+    if (req->buf == firstInvalid || errno != 0) {
+#ifndef NDEBUG
+        fprintf(stderr, "invalid number, '%s'\n", req->buf);
+#endif
+        return FAILED;
+    }
+#ifndef NDEBUG
+    fprintf(stderr, "id is %d\n", id);
+#endif
+
+    req->id = id;
+    int idx = getIndexOfId(id);
+    if (idx < 0)
+        // ID not found
+        return FAILED;
+
+#ifdef READ_SERVER
+    Result res = loadRecord(req, idx, false);
+#else
+    // kept for the order, unless it came in through -R
+    Result res = loadRecord(req, idx, !req->reader);
+#endif
+    if (res != SUCCESS)
+        return res;
+
+    queueText(req, "You can order %d adult mask(s) and %d children mask(s).\n",
+              core.orders[idx].adultMask, core.orders[idx].childrenMask);
+    return SUCCESS;
+}
+
+#ifndef READ_SERVER
+static Result handleOrder(Request* req) {
+    int idx = getIndexOfId(req->id);
+    if (idx < 0)
+        // ID not found
+        return FAILED;
+
+    int nRead = readRequest(req);
+    if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return AGAIN;
+    if (nRead <= 0) {
+        // 0: disconnect
+        // -1: error
+        releaseLock(req, idx);
+        return FAILED;
+    }
+
+    int orderChild = 0;
+    int orderAdult = 0;
+    nRead = 0;
+    if (sscanf(req->buf, "adult %d%n", &orderAdult, &nRead) != 1 &&
+        sscanf(req->buf, "children %d%n", &orderChild, &nRead) != 1) {
+        // no valid command
+        releaseLock(req, idx);
+        return FAILED;
+    }
+
+    for (int i = nRead; req->buf[i]; ++i)
         if (!isspace(req->buf[i])) {
             // check for extra character(s)
             releaseLock(req, idx);
             return FAILED;
         }
 #ifndef NDEBUG
-    fprintf(stderr, "Ordered adult: %d, children: %d\n", orderAdult,
-            orderChild);
+    fprintf(stderr, "Ordered adult: %d, children: %d\n", orderAdult,
+            orderChild);
+#endif
+
+    Result res = placeOrder(req, idx, orderAdult, orderChild);
+    if (res == SUCCESS)
+        replyOrder(req, orderAdult, orderChild);
+    return res;
+}
+#endif
+
+// Copy the record of idx into core.orders[idx] and orderBuf, keeping it
+// write-locked for an order if lock is set.
+static Result loadRecord(Request* req, int idx, bool lock) {
+    Result res = copyRecord(req, idx, &orderBuf);
+    if (res != SUCCESS)
+        return res;
+    if (lock && tryAcquireWriteLock(req, idx) < 0)
+        return LOCKED;
+    core.orders[idx] = orderBuf;  // The record is not locked now
+    return SUCCESS;
+}
+
+#ifndef READ_SERVER
+// Write an order for the record of idx, which req has write-locked with
+// loadRecord(). The lock is released, unless the order is PENDING in a batch.
+// orderBuf holds the record after the order.
+static Result placeOrder(Request* req, int idx, int orderAdult,
+                         int orderChild) {
+    // The lock is owned by another request in this process
+    if (lockInfo[idx].owner != req) {
+#ifndef NDEBUG
+        fprintf(stderr, "owner is %p, current request is %p\n",
+                lockInfo[idx].owner, req);
+#endif
+        return LOCKED;
+    }
+
+#ifndef NDEBUG
+    fprintf(stderr, "%d/%d, %d/%d\n", orderAdult, core.orders[idx].adultMask,
+            orderChild, core.orders[idx].childrenMask);
+#endif
+
+    if (orderAdult > core.orders[idx].adultMask ||
+        orderChild > core.orders[idx].childrenMask ||
+        (orderAdult <= 0 && orderChild <= 0)) {
+        releaseLock(req, idx);
+        // number not in range: negative / zero / too large
+        return FAILED;
+    }
+
+    orderBuf.id = req->id;
+    orderBuf.adultMask = core.orders[idx].adultMask - orderAdult;
+    orderBuf.childrenMask = core.orders[idx].childrenMask - orderChild;
+
+    if (groupWindow >= 0) {
+        // keep the write lock until the batch is written
+        if (pendingOrdersLen == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &groupDeadline);
+            groupDeadline.tv_nsec += groupWindow % 1000000 * 1000;
+            groupDeadline.tv_sec += groupWindow / 1000000 +
+                                    groupDeadline.tv_nsec / 1000000000;
+            groupDeadline.tv_nsec %= 1000000000;
+        }
+        pendingOrders[pendingOrdersLen++] =
+            (PendingOrder){.req = req,
+                           .idx = idx,
+                           .order = orderBuf,
+                           .orderAdult = orderAdult,
+                           .orderChild = orderChild};
+        req->pending = true;
+        return PENDING;
+    }
+
+    if (writeRecord(idx, &orderBuf) < 0) {
+        releaseLock(req, idx);
+        return FAILED;
+    }
+
+    if (releaseLock(req, idx) < 0)
+        return FAILED;
+    return SUCCESS;
+}
+#endif
+
+static void replyOrder(Request* req, int orderAdult, int orderChild) {
+    if (orderAdult) {
+        queueText(req,
+                  "Pre-order for %d successed, %d adult mask(s) ordered.\n",
+                  req->id, orderAdult);
+
+    } else {
+        queueText(req,
+                  "Pre-order for %d successed, %d children mask(s) ordered.\n",
+                  req->id, orderChild);
+    }
+}
+
+static Result handleBinary(Request* req) {
+    int nRead = readFrame(req);
+    if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return AGAIN;
+    if (nRead == 0)
+        return CLOSED;
+    BinRequest bin;
+    memcpy(&bin, req->buf, sizeof(bin));
+    int id = (int32_t)le32toh(bin.id);
+    // a malformed request gets BIN_FAILED, then the connection is closed
+    // because where the next request starts is unknown
+    if (nRead < 0 && errno == EPROTO)
+        replyBinary(req, FAILED, id, NULL);
+    if (nRead < 0)
+        return FAILED;
+    if (bin.op == BIN_LOOKUP || bin.op == BIN_BATCH_LOOKUP) {
+        int count = bin.op == BIN_LOOKUP ? 1 : le16toh(bin.count);
+        for (int i = 0; i < count; ++i) {
+            if (bin.op == BIN_BATCH_LOOKUP) {
+                memcpy(&id, req->buf + sizeof(bin) + i * sizeof(id),
+                       sizeof(id));
+                id = (int32_t)le32toh(id);
+            }
+            int idx = getIndexOfId(id);
+            Result res = idx < 0 ? FAILED : copyRecord(req, idx, &orderBuf);
+            replyBinary(req, res, id, &orderBuf);
+        }
+        return SUCCESS;
+    }
+    if (bin.op != BIN_ORDER) {
+        replyBinary(req, FAILED, id, NULL);
+        return FAILED;
+    }
+#ifdef READ_SERVER
+    replyBinary(req, FAILED, id, NULL);
+    return SUCCESS;
+#else
+    int amount = (int32_t)le32toh(bin.amount);
+    int idx = getIndexOfId(id);
+    Result res = FAILED;
+    if (idx >= 0 && (bin.type == BIN_ADULT || bin.type == BIN_CHILDREN)) {
+        req->id = id;
+        res = loadRecord(req, idx, true);
+        if (res == SUCCESS)
+            res = placeOrder(req, idx, bin.type == BIN_ADULT ? amount : 0,
+                             bin.type == BIN_CHILDREN ? amount : 0);
+        if (res == PENDING)
+            return PENDING;  // flushOrders() replies
+    }
+    replyBinary(req, res, id, &orderBuf);
+    return SUCCESS;
+#endif
+}
+
+// Frame the next binary request in req->buf, as readRequest() does for
+// lines. Returns its length, 0 if the client closed, -1 on error: errno is
+// EAGAIN while the request is incomplete and EPROTO if it is malformed.
+static int readFrame(Request* req) {
+    if (req->line_len) {
+        req->buf_len -= req->line_len;
+        memmove(req->buf, req->buf + req->line_len, req->buf_len);
+        req->line_len = 0;
+    }
+    while (1) {
+        if (req->buf_len >= sizeof(BinRequest)) {
+            BinRequest bin;
+            memcpy(&bin, req->buf, sizeof(bin));
+            size_t len = sizeof(bin);
+            if (bin.op == BIN_BATCH_LOOKUP) {
+                if (le16toh(bin.count) > BIN_BATCH_MAX) {
+                    errno = EPROTO;
+                    return -1;
+                }
+                len += le16toh(bin.count) * sizeof(int32_t);
+            }
+            if (req->buf_len >= len) {
+                req->line_len = len;
+                return len;
+            }
+        }
+        int nRead = receive(req, req->buf + req->buf_len,
+                            sizeof(req->buf) - req->buf_len);
+        if (nRead > 0) {
+            req->buf_len += nRead;
+            metrics.bytesIn += nRead;
+            continue;
+        }
+        if (nRead < 0 && errno == EINTR)
+            continue;
+        return nRead;  // a request cut short by EOF is dropped
+    }
+}
+
+static void replyBinary(Request* req, Result res, int id, const Order* order) {
+    BinReply reply = {.status = res == SUCCESS  ? BIN_OK
+                                : res == LOCKED ? BIN_LOCKED
+                                                : BIN_FAILED,
+                      .id = htole32(id)};
+    if (res == SUCCESS) {
+        reply.adultMask = htole32(order->adultMask);
+        reply.childrenMask = htole32(order->childrenMask);
+    }
+    queueBytes(req, &reply, sizeof(reply));
+}
+
+// the id prompt got "bulk ...", req->buf holds the line
+static Result startBulk(Request* req) {
+    Bulk* bulk = (Bulk*)calloc(1, sizeof(Bulk));
+    if (bulk == NULL)
+        return FAILED;
+    req->bulk = bulk;
+    char* rest;
+    strtok_r(req->buf, " \t\r", &rest);  // "bulk"
+    char* mode = strtok_r(NULL, " \t\r", &rest);
+    if (mode && strcmp(mode, "order") == 0) {
+        char* how = strtok_r(NULL, " \t\r", &rest);
+        bulk->order = true;
+        bulk->atomic = how && strcmp(how, "all") == 0;
+        bulk->bad = !bulk->atomic && !(how && strcmp(how, "any") == 0);
+#ifdef READ_SERVER
+        bulk->bad = true;
+#endif
+        if (req->reader)
+            bulk->bad = true;
+    } else if (!mode || strcmp(mode, "lookup") != 0) {
+        bulk->bad = true;
+    }
+    // the list is consumed up to the blank line even if it is bad, so that
+    // its items are not taken for ids
+    if (!bulk->bad && parseBulkItems(bulk, rest) < 0)
+        bulk->bad = true;
+    return handleBulk(req);
+}
+
+// collect the items of the bulk command up to the blank line, then answer
+static Result handleBulk(Request* req) {
+    Bulk* bulk = req->bulk;
+    while (1) {
+        int nRead = readRequest(req);
+        if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return AGAIN;
+        if (nRead < 0 && errno == EMSGSIZE) {
+            bulk->bad = true;
+            continue;
+        }
+        if (nRead <= 0) {
+            freeBulk(req);
+            return FAILED;
+        }
+        if (idTimeout)
+            armTimer(&req->stateTimer, idTimeout);
+        char* c = req->buf;
+        while (isspace(*c))
+            ++c;
+        if (*c == '\0')
+            break;
+        if (!bulk->bad && parseBulkItems(bulk, req->buf) < 0)
+            bulk->bad = true;
+    }
+    // the reply is allocated first, orders must not be placed unanswered
+    if (!bulk->bad)
+        bulk->reply = (char*)malloc((size_t)bulk->len * BULK_LINE_MAX + 32);
+    if (bulk->reply == NULL) {
+        freeBulk(req);
+        return FAILED;
+    }
+    runBulk(req, bulk);
+    replyBulk(req, bulk);
+    // like an order, the list ends the dialogue
+    req->nextActionId = actionsLen - 1;
+    return SUCCESS;
+}
+
+static int parseInt(const char* str, int* value) {
+    char* end;
+    errno = 0;
+    long n = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0 || n < INT32_MIN ||
+        n > INT32_MAX)
+        return -1;
+    *value = (int)n;
+    return 0;
+}
+
+// append the items on a line of the bulk command, -1 if it is malformed
+static int parseBulkItems(Bulk* bulk, char* line) {
+    char* rest;
+    for (char* tok = strtok_r(line, " \t\r", &rest); tok;
+         tok = strtok_r(NULL, " \t\r", &rest)) {
+        BulkItem item = {.pos = bulk->len};
+        if (parseInt(tok, &item.id) < 0)
+            return -1;
+        if (bulk->order) {
+            char* type = strtok_r(NULL, " \t\r", &rest);
+            char* count = strtok_r(NULL, " \t\r", &rest);
+            int n;
+            if (type == NULL || count == NULL || parseInt(count, &n) < 0)
+                return -1;
+            if (strcmp(type, "adult") == 0)
+                item.orderAdult = n;
+            else if (strcmp(type, "children") == 0)
+                item.orderChild = n;
+            else
+                return -1;
+        }
+        if (bulk->len == bulk->cap) {
+            if (bulk->cap == BULK_MAX)
+                return -1;
+            int cap = bulk->cap ? bulk->cap * 2 : 64;
+            BulkItem* items =
+                (BulkItem*)realloc(bulk->items, sizeof(BulkItem) * cap);
+            if (items == NULL)
+                return -1;
+            bulk->items = items;
+            bulk->cap = cap;
+        }
+        bulk->items[bulk->len++] = item;
+    }
+    return 0;
+}
+
+static int compareBulkIdx(const void* a, const void* b) {
+    const BulkItem *x = (const BulkItem*)a, *y = (const BulkItem*)b;
+    return x->idx != y->idx ? x->idx - y->idx : x->pos - y->pos;
+}
+
+static int compareBulkPos(const void* a, const void* b) {
+    return ((const BulkItem*)a)->pos - ((const BulkItem*)b)->pos;
+}
+
+// Answer every item of the list. Each record is locked once, in index order
+// so that two bulk commands cannot each hold what the other waits for, and
+// runs of adjacent records are read and written with one preadv/pwritev.
+static void runBulk(Request* req, Bulk* bulk) {
+    BulkItem* items = bulk->items;
+    for (int i = 0; i < bulk->len; ++i) {
+        items[i].idx = getIndexOfId(items[i].id);
+        items[i].res = items[i].idx < 0 ? FAILED : SUCCESS;
+    }
+    qsort(items, bulk->len, sizeof(BulkItem), compareBulkIdx);
+    BulkRecord* recs =
+        (BulkRecord*)malloc(sizeof(BulkRecord) * (bulk->len ? bulk->len : 1));
+    if (recs == NULL) {
+        for (int i = 0; i < bulk->len; ++i)
+            items[i].res = FAILED;
+        qsort(items, bulk->len, sizeof(BulkItem), compareBulkPos);
+        return;
+    }
+    int nRecs = 0;
+    for (int i = 0; i < bulk->len; ++i) {
+        if (items[i].idx < 0)
+            continue;
+        if (nRecs == 0 || recs[nRecs - 1].idx != items[i].idx)
+            recs[nRecs++] = (BulkRecord){.idx = items[i].idx, .res = AGAIN};
+        items[i].rec = nRecs - 1;
+    }
+
+    bool aborted = false;
+#ifdef READ_SERVER
+    // seqlock copies or a replica's, there are no locks to hold across a run
+    bool copy = core.table.slots != NULL || ownRecords;
+#else
+    // lookups copy core.orders, see copyRecord()
+    bool copy = ownRecords && !bulk->order;
+#endif
+    if (copy) {
+        for (int r = 0; r < nRecs; ++r)
+            recs[r].res = copyRecord(req, recs[r].idx, &recs[r].order);
+    } else {
+        for (int r = 0; r < nRecs && !aborted; ++r) {
+            int ret = bulk->order ? tryAcquireWriteLock(req, recs[r].idx)
+                                  : tryAcquireReadLock(req, recs[r].idx);
+            recs[r].res = ret < 0 ? LOCKED : SUCCESS;
+            aborted = ret < 0 && bulk->atomic;
+        }
+        if (!aborted)
+            transferBulk(recs, nRecs, false);
+    }
+
+    for (int i = 0; i < bulk->len; ++i) {
+        BulkItem* item = &items[i];
+        if (item->res != SUCCESS)
+            continue;  // unknown id
+        BulkRecord* rec = &recs[item->rec];
+        item->res = rec->res;
+        if (rec->res != SUCCESS || aborted)
+            continue;  // aborted: the records have not been read
+        Order* order = &rec->order;
+        if (bulk->order) {
+            if (item->orderAdult > order->adultMask ||
+                item->orderChild > order->childrenMask ||
+                (item->orderAdult <= 0 && item->orderChild <= 0)) {
+                item->res = FAILED;
+                continue;
+            }
+            order->id = item->id;
+            order->adultMask -= item->orderAdult;
+            order->childrenMask -= item->orderChild;
+            rec->dirty = true;
+        }
+        item->order = *order;
+    }
+    if (bulk->atomic)
+        for (int i = 0; i < bulk->len && !aborted; ++i)
+            aborted = items[i].res != SUCCESS;
+
+    if (bulk->order && !aborted) {
+        int first = -1, last = -1;
+        for (int r = 0; r < nRecs; ++r)
+            if (recs[r].dirty) {
+                first = first < 0 ? recs[r].idx : first;
+                last = recs[r].idx;
+            }
+        // a failed write leaves the run FAILED, then one barrier for all
+        if (first >= 0 && transferBulk(recs, nRecs, true) == 0) {
+            int ret = 0;
+            if (records && (syncPolicy == SYNC_WRITE ||
+                            (groupWindow >= 0 && barrier != BARRIER_NONE)))
+                ret = msyncRecords(first, last);
+            else if (!records && groupWindow >= 0 && barrier != BARRIER_NONE)
+                ret = syncOrders();
+            if (ret < 0)
+                for (int r = 0; r < nRecs; ++r)
+                    if (recs[r].dirty)
+                        recs[r].res = FAILED;
+        }
+        for (int i = 0; i < bulk->len; ++i)
+            if (items[i].res == SUCCESS && recs[items[i].rec].res != SUCCESS)
+                items[i].res = FAILED;
+    }
+    for (int r = 0; r < nRecs; ++r)
+        if (lockInfo[recs[r].idx].owner == req)
+            releaseLock(req, recs[r].idx);
+    free(recs);
+
+    if (aborted)
+        for (int i = 0; i < bulk->len; ++i)
+            if (items[i].res == SUCCESS)
+                items[i].res = AGAIN;
+    qsort(items, bulk->len, sizeof(BulkItem), compareBulkPos);
+}
+
+// Read the held records, or write back the ones changed, one preadv/pwritev
+// per run of adjacent records. A run that fails is marked FAILED, -1 then.
+// With -U every run is queued first and they are submitted together.
+static int transferBulk(BulkRecord* recs, int nRecs, bool write) {
+    if (wal.path || (ownRecords && !write))
+        return transferLog(recs, nRecs, write);
+    bool queue = fileRing.fd >= 0 && !records;
+    struct iovec iov[BATCH_IOV];
+    int ret = 0;
+    for (int r = 0, j; r < nRecs; r = j) {
+        j = bulkRunEnd(recs, nRecs, r, write);
+        if (j == r) {
+            ++j;  // not held, or unchanged
+            continue;
+        }
+        size_t total = 0;
+        for (int k = r; k < j; ++k) {
+            iov[k - r].iov_base = &recs[k].order;
+            iov[k - r].iov_len = sizeof(Order);
+            total += sizeof(Order);
+        }
+        if (write && core.table.slots)
+            for (int k = r; k < j; ++k)
+                beginUpdateLockTable(&core.table, recs[k].idx);
+        off_t offset = (off_t)recs[r].idx * sizeof(Order);
+        if (queue) {
+            recs[r].failed = false;
+            queueRun(write, iov, j - r, offset, &recs[r].failed);
+            continue;
+        }
+        ssize_t n = total;
+        if (records) {
+            for (int k = r; k < j; ++k)
+                if (write)
+                    records[recs[k].idx] = recs[k].order;
+                else
+                    recs[k].order = records[recs[k].idx];
+        } else {
+            do {
+                n = write ? pwritev(core.fd, iov, j - r, offset)
+                          : preadv(core.fd, iov, j - r, offset);
+            } while (n < 0 && errno == EINTR);
+        }
+        if (finishBulkRun(recs, r, j, write, n == (ssize_t)total) < 0)
+            ret = -1;
+    }
+    if (!queue)
+        return ret;
+    submitRuns(false);
+    // the same runs again: finishing one does not change where the next ends
+    for (int r = 0, j; r < nRecs; r = j) {
+        j = bulkRunEnd(recs, nRecs, r, write);
+        if (j == r)
+            ++j;
+        else if (finishBulkRun(recs, r, j, write, !recs[r].failed) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+// end of the run of records from r that transferBulk() reads or writes
+// with one call, r if recs[r] is not held or unchanged
+static int bulkRunEnd(BulkRecord* recs, int nRecs, int r, bool write) {
+    int j = r;
+    while (j < nRecs && j - r < BATCH_IOV && recs[j].res == SUCCESS &&
+           (!write || recs[j].dirty) && recs[j].idx == recs[r].idx + (j - r))
+        ++j;
+    return j;
+}
+
+// after the run recs[r..j) has been transferred, -1 if it failed
+static int finishBulkRun(BulkRecord* recs, int r, int j, bool write, bool ok) {
+    if (write && core.table.slots)
+        for (int k = r; k < j; ++k)
+            endUpdateLockTable(&core.table, recs[k].idx);
+    for (int k = r; k < j; ++k) {
+        if (!ok) {
+            recs[k].res = FAILED;
+            continue;
+        }
+        if (write)
+            storeRecord(recs[k].idx, &recs[k].order);
+        else
+            core.orders[recs[k].idx] = recs[k].order;
+    }
+    return ok ? 0 : -1;
+}
+
+// transferBulk() from core.orders: the held records are copied from it, with -L
+// the changed ones are appended to the log with one write
+static int transferLog(BulkRecord* recs, int nRecs, bool write) {
+    int n = 0;
+    for (int r = 0; r < nRecs; ++r) {
+        if (recs[r].res != SUCCESS)
+            continue;
+        if (!write) {
+            recs[r].order = core.orders[recs[r].idx];
+        } else if (recs[r].dirty) {
+            const Order* order = &recs[r].order;
+            walBuf[n++] = (WalEntry){.idx = recs[r].idx,
+                                     .id = order->id,
+                                     .adultMask = order->adultMask,
+                                     .childrenMask = order->childrenMask};
+        }
+    }
+    if (n == 0 || logRecords(n) == 0)
+        return 0;
+    for (int r = 0; r < nRecs; ++r)
+        if (recs[r].res == SUCCESS && recs[r].dirty)
+            recs[r].res = FAILED;
+    return -1;
+}
+
+// format the answer to every item into bulk->reply and queue it
+static void replyBulk(Request* req, Bulk* bulk) {
+    char* text = bulk->reply;
+    int nSucceeded = 0;
+    for (int i = 0; i < bulk->len; ++i) {
+        BulkItem* item = &bulk->items[i];
+        switch (item->res) {
+        case SUCCESS:
+            ++nSucceeded;
+            text += sprintf(text, "%d ok %d %d\n", item->id,
+                            item->order.adultMask, item->order.childrenMask);
+            break;
+        case LOCKED:
+            text += sprintf(text, "%d locked\n", item->id);
+            break;
+        case AGAIN:
+            text += sprintf(text, "%d aborted\n", item->id);
+            break;
+        default:
+            text += sprintf(text, "%d failed\n", item->id);
+            break;
+        }
+    }
+    sprintf(text, "%d of %d succeeded.\n", nSucceeded, bulk->len);
+    free(bulk->items);
+    bulk->items = NULL;
+    bulk->len = bulk->cap = 0;
+    queueStr(req, bulk->reply);
+}
+
+static void freeBulk(Request* req) {
+    if (req->bulk == NULL)
+        return;
+    free(req->bulk->items);
+    free(req->bulk->reply);
+    free(req->bulk);
+    req->bulk = NULL;
+}
+
+// a command on the admin port: "stats", "reset", "total" for the stock of
+// each SKU or "below sku n" for the ids with less than n of it
+static Result handleAdmin(Request* req) {
+    int nRead = readRequest(req);
+    if (nRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return AGAIN;
+    if (nRead == 0)
+        return CLOSED;
+    if (nRead < 0)
+        return FAILED;
+    char cmd[16] = "", sku[16] = "";
+    int threshold;
+    int nArgs = sscanf(req->buf, "%15s %15s %d", cmd, sku, &threshold);
+    int skuIdx = nArgs == 3 ? skuOfInventory(&inventory, sku) : -1;
+    if (strcmp(cmd, "stats") == 0) {
+        char text[STATS_MAX];
+        int len = formatStats(text, sizeof(text));
+        queueBytes(req, text, len < STATS_MAX ? len : STATS_MAX - 1);
+    } else if (strcmp(cmd, "reset") == 0) {
+        resetStats();
+        queueStr(req, "OK.\n");
+    } else if (strcmp(cmd, "total") == 0 ||
+               (strcmp(cmd, "below") == 0 && skuIdx >= 0)) {
+        char text[STATS_MAX];
+        int len = refreshStock() < 0 ? -1
+                  : cmd[0] == 't'    ? formatTotal(text, sizeof(text))
+                                     : formatBelow(text, sizeof(text), skuIdx,
+                                                   threshold);
+        if (len < 0)
+            queueStr(req, failedMsg);
+        else
+            queueBytes(req, text, len < STATS_MAX ? len : STATS_MAX - 1);
+    } else {
+        queueStr(req, failedMsg);
+    }
+    return SUCCESS;
+}
+
+static void appendText(char* buf, size_t size, int* len, const char* fmt,
+                       ...) {
+    if ((size_t)*len >= size)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *len += n;
+}
+
+// "name value" lines, then the most contended records; as snprintf()
+// returns
+static int formatStats(char* buf, size_t size) {
+    int len = 0;
+    appendText(buf, size, &len,
+               "uptime_ms %ld\nrecords %d\nconnections %d\naccepted %llu\n"
+               "shed %llu\ntimed_out %llu\nbytes_in %llu\nbytes_out %llu\n"
+               "poll_wakeups %llu\npoll_events %llu\n",
+               nowMs() - startedMs, core.len, nConns,
+               (unsigned long long)metrics.accepted,
+               (unsigned long long)metrics.shed,
+               (unsigned long long)metrics.timedOut,
+               (unsigned long long)metrics.bytesIn,
+               (unsigned long long)metrics.bytesOut,
+               (unsigned long long)metrics.wakeups,
+               (unsigned long long)metrics.events);
+    for (int i = 0; i < N_HANDLERS; ++i) {
+        appendText(buf, size, &len, "handler_%s handled=%llu ",
+                   handlerNames[i], (unsigned long long)metrics.handled[i]);
+        if ((size_t)len < size)
+            len += formatHistogram(buf + len, size - len, &metrics.handlers[i]);
+        appendText(buf, size, &len, "\n");
+    }
+    appendText(buf, size, &len, "lock_wait ");
+    if ((size_t)len < size)
+        len += formatHistogram(buf + len, size - len, &metrics.lockWait);
+    appendText(buf, size, &len, "\nlock_acquired %llu\nlock_failed %llu\n",
+               (unsigned long long)metrics.lockAcquired,
+               (unsigned long long)metrics.lockFailed);
+    if (feed.writer) {
+        appendText(buf, size, &len, "feed_published %llu\n",
+                   (unsigned long long)headOfFeed(&feed));
+    } else if (feed.ring) {
+        appendText(buf, size, &len,
+                   "replica_applied %llu\nreplica_behind %llu\n"
+                   "replica_resyncs %llu\nreplica_lag ",
+                   (unsigned long long)metrics.feedApplied,
+                   (unsigned long long)(headOfFeed(&feed) - feed.next),
+                   (unsigned long long)metrics.feedResyncs);
+        if ((size_t)len < size)
+            len += formatHistogram(buf + len, size - len, &metrics.feedLag);
+        appendText(buf, size, &len, "\n");
+    }
+
+    // the records that failed the most lock attempts, then the busiest
+    int top[STATS_TOP_RECORDS], nTop = 0;
+    for (int idx = 0; idx < core.len; ++idx) {
+        LockInfo* info = &lockInfo[idx];
+        if (info->acquired == 0 && info->failed == 0)
+            continue;
+        int pos = nTop;
+        while (pos > 0 &&
+               (lockInfo[top[pos - 1]].failed < info->failed ||
+                (lockInfo[top[pos - 1]].failed == info->failed &&
+                 lockInfo[top[pos - 1]].acquired < info->acquired))) {
+            if (pos < STATS_TOP_RECORDS)
+                top[pos] = top[pos - 1];
+            --pos;
+        }
+        if (pos < STATS_TOP_RECORDS)
+            top[pos] = idx;
+        if (nTop < STATS_TOP_RECORDS)
+            ++nTop;
+    }
+    for (int i = 0; i < nTop; ++i)
+        appendText(buf, size, &len, "record %d acquired=%u failed=%u\n",
+                   abs(core.orders[top[i]].id), lockInfo[top[i]].acquired,
+                   lockInfo[top[i]].failed);
+    return len;
+}
+
+// "total sku n" for each SKU, as snprintf() returns
+static int formatTotal(char* buf, size_t size) {
+    int len = 0;
+    for (int s = 0; s < inventory.nSkus; ++s)
+        appendText(buf, size, &len, "total %s %lld\n", inventory.names[s],
+                   (long long)sumInventory(&inventory, s));
+    return len;
+}
+
+// "below sku n count c", then an "id stock" line for each record found as
+// long as they fit, "..." if they did not
+static int formatBelow(char* buf, size_t size, int sku, int threshold) {
+    static int found[BELOW_LIST_MAX];
+    int n = belowInventory(&inventory, sku, threshold, found, BELOW_LIST_MAX);
+    int len = 0;
+    appendText(buf, size, &len, "below %s %d count %d\n",
+               inventory.names[sku], threshold, n);
+    for (int i = 0; i < n; ++i) {
+        if (i == BELOW_LIST_MAX || (size_t)len + BELOW_LINE_MAX >= size) {
+            appendText(buf, size, &len, "...\n");
+            break;
+        }
+        appendText(buf, size, &len, "%d %d\n", inventory.ids[found[i]],
+                   inventory.stock[sku][found[i]]);
+    }
+    return len;
+}
+
+// write the stats to statsPath through a rename, a reader never sees half
+static void dumpStats() {
+    char text[STATS_MAX], tmp[PATH_MAX];
+    int len = formatStats(text, sizeof(text));
+    if (len >= STATS_MAX)
+        len = STATS_MAX - 1;
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", statsPath) >= (int)sizeof(tmp))
+        return;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("failed to dump stats");
+        return;
+    }
+    bool written = write(fd, text, len) == len;
+    close(fd);
+    if (!written || rename(tmp, statsPath) < 0) {
+        perror("failed to dump stats");
+        unlink(tmp);
+    }
+}
+
+// the time now if this is one of the calls to be timed, 0 otherwise
+static uint64_t startSample() {
+    return ++metrics.ticks % STATS_SAMPLE == 0 ? nowNs() : 0;
+}
+
+static void onStatsTimer(Timer* timer) {
+    dumpStats();
+    armTimer(timer, statsInterval * 1000);
+}
+
+static void resetStats() {
+    memset(&metrics, 0, sizeof(metrics));
+    for (int i = 0; i < core.len; ++i)
+        lockInfo[i].acquired = lockInfo[i].failed = 0;
+}
+
+// milliseconds until the pending batch is due, -1 if there is none
+static int groupTimeout() {
+    if (pendingOrdersLen == 0)
+        return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (groupDeadline.tv_sec - now.tv_sec) * 1000000 +
+              (groupDeadline.tv_nsec - now.tv_nsec) / 1000;
+    return us > 0 ? (int)((us + 999) / 1000) : 0;
+}
+
+static int comparePendingOrder(const void* a, const void* b) {
+    return ((const PendingOrder*)a)->idx - ((const PendingOrder*)b)->idx;
+}
+
+static void flushOrders() {
+    if (pendingOrdersLen == 0)
+        return;
+    qsort(pendingOrders, pendingOrdersLen, sizeof(PendingOrder),
+          comparePendingOrder);
+    int ret = writeOrders();
+#ifndef NDEBUG
+    fprintf(stderr, "committed %d order(s): %d\n", pendingOrdersLen, ret);
 #endif
+    int len = pendingOrdersLen;
+    pendingOrdersLen = 0;
+    for (int i = 0; i < len; ++i) {
+        PendingOrder* p = &pendingOrders[i];
+        Request* req = p->req;
+        req->pending = false;
+        Result res = FAILED;
+        if (releaseLock(req, p->idx) == 0 && ret == 0)
+            res = SUCCESS;
+        if (req->binary) {
+            replyBinary(req, res, req->id, &p->order);
+            res = SUCCESS;  // answered either way
+        } else if (res == SUCCESS) {
+            replyOrder(req, p->orderAdult, p->orderChild);
+        }
+        if (finishAction(req, res))
+            serveRequest(req);
+    }
+}
 
-    // The lock is owned by another request in this process
-    if (lockInfo[idx].owner != req) {
+// write the sorted batch, one pwritev per run of adjacent records, then one
+// barrier for all of them
+static int writeOrders() {
+    int ret = 0;
+    if (wal.path) {
+        for (int i = 0; i < pendingOrdersLen; ++i) {
+            const Order* order = &pendingOrders[i].order;
+            walBuf[i] = (WalEntry){.idx = pendingOrders[i].idx,
+                                   .id = order->id,
+                                   .adultMask = order->adultMask,
+                                   .childrenMask = order->childrenMask};
+        }
+        ret = logRecords(pendingOrdersLen);
+        return ret < 0 || barrier == BARRIER_NONE ? ret : syncOrders();
+    }
+    if (core.table.slots)
+        for (int i = 0; i < pendingOrdersLen; ++i)
+            beginUpdateLockTable(&core.table, pendingOrders[i].idx);
+    // -U sends the barrier along, unless lock table readers would retry
+    // for as long as it takes
+    bool synced = fileRing.fd >= 0 && !records && barrier != BARRIER_NONE &&
+                  !core.table.slots;
+    if (records) {
+        for (int i = 0; i < pendingOrdersLen; ++i)
+            records[pendingOrders[i].idx] = pendingOrders[i].order;
+    } else {
+        struct iovec iov[BATCH_IOV];
+        bool failed = false;
+        for (int i = 0, j; i < pendingOrdersLen && ret == 0; i = j) {
+            int first = pendingOrders[i].idx;
+            size_t total = 0;
+            for (j = i; j < pendingOrdersLen && j - i < BATCH_IOV &&
+                        pendingOrders[j].idx == first + (j - i);
+                 ++j) {
+                iov[j - i].iov_base = &pendingOrders[j].order;
+                iov[j - i].iov_len = sizeof(Order);
+                total += sizeof(Order);
+            }
+            if (fileRing.fd >= 0) {
+                queueRun(true, iov, j - i, (off_t)first * sizeof(Order),
+                         &failed);
+                continue;
+            }
+            ssize_t n;
+            do {
+                n = pwritev(core.fd, iov, j - i, (off_t)first * sizeof(Order));
+            } while (n < 0 && errno == EINTR);
+            if (n != (ssize_t)total)
+                ret = -1;
+        }
+        if (fileRing.fd >= 0 && (submitRuns(synced) < 0 || failed))
+            ret = -1;
+    }
+    if (ret == 0)
+        for (int i = 0; i < pendingOrdersLen; ++i) {
+            storeRecord(pendingOrders[i].idx, &pendingOrders[i].order);
+        }
+    if (core.table.slots)
+        for (int i = 0; i < pendingOrdersLen; ++i)
+            endUpdateLockTable(&core.table, pendingOrders[i].idx);
+    if (ret < 0 || barrier == BARRIER_NONE || synced)
+        return ret;
+
+    if (records)
+        return msyncRecords(pendingOrders[0].idx,
+                            pendingOrders[pendingOrdersLen - 1].idx);
+    return syncOrders();
+}
+
+// the -b barrier on the file orders are written to
+static int syncOrders() {
+    int fd = wal.path ? wal.fd : core.fd;
+    return barrier == BARRIER_FSYNC ? fsync(fd) : fdatasync(fd);
+}
+
+// -U: record batches go through fileRing, unless preorderRecord is mapped
+// or -L logs orders instead
+static void initRecordRing() {
+    if (records || wal.path ||
+        initUring(&fileRing, BATCH_IOV, IORING_SETUP_SINGLE_ISSUER) < 0)
+        return;
+    fixedRecordFd =
+        registerUring(&fileRing, IORING_REGISTER_FILES, &core.fd, 1) == 0;
+}
+
+// queue a readv/writev of the run at offset, its iovecs are copied
+static void queueRun(bool write, const struct iovec* iov, int n, off_t offset,
+                     bool* failed) {
+    if (runIovLen + n > BATCH_IOV)
+        submitRuns(false);
+    size_t total = 0;
+    for (int i = 0; i < n; ++i)
+        total += iov[i].iov_len;
+    memcpy(&runIov[runIovLen], iov, sizeof(struct iovec) * n);
+    struct io_uring_sqe* sqe = takeSqe(&fileRing);
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fixedRecordFd ? 0 : core.fd;
+    sqe->flags = fixedRecordFd ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uintptr_t)&runIov[runIovLen];
+    sqe->len = n;
+    sqe->off = offset;
+    sqe->user_data = queuedRunsLen;
+    queuedRuns[queuedRunsLen++] = (QueuedRun){.total = total, .failed = failed};
+    runIovLen += n;
+}
+
+// Submit the queued runs, then the -b barrier after all of them if sync,
+// and wait for every one. -1 if the barrier failed, a run that came up
+// short sets its flag.
+static int submitRuns(bool sync) {
+    int left = queuedRunsLen, ret = 0;
+    if (sync) {
+        struct io_uring_sqe* sqe = takeSqe(&fileRing);
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fixedRecordFd ? 0 : core.fd;
+        sqe->flags = IOSQE_IO_DRAIN | (fixedRecordFd ? IOSQE_FIXED_FILE : 0);
+        sqe->fsync_flags =
+            barrier == BARRIER_FDATASYNC ? IORING_FSYNC_DATASYNC : 0;
+        sqe->user_data = BATCH_IOV;  // not a run
+        ++left;
+    }
+    while (left > 0) {
+        if (submitUring(&fileRing, left, -1) < 0)
+            ERR_EXIT("io_uring_enter");
+        struct io_uring_cqe* cqe;
+        while ((cqe = peekCqe(&fileRing)) != NULL) {
+            if (cqe->user_data == BATCH_IOV)
+                ret = cqe->res < 0 ? -1 : 0;
+            else if (cqe->res != (int)queuedRuns[cqe->user_data].total)
+                *queuedRuns[cqe->user_data].failed = true;
+            seenCqe(&fileRing);
+            --left;
+        }
+    }
+    runIovLen = queuedRunsLen = 0;
+    return ret;
+}
+
+static int initializeRecords() {
+    if (openCsieMask(&core, recordPath) < 0)
+        return -1;
+    initTimer(&growTimer, onGrowTimer);
+    lockInfoCap = core.cap;
+    if (initInventory(&inventory, 2, skuNames, core.len) < 0)
+        ERR_EXIT("out of memory allocating the stock columns");
+    loadStock(0, core.len);
+
+    lockInfo = (LockInfo*)malloc(sizeof(LockInfo) * (core.len ? core.len : 1));
+    memset(lockInfo, 0,
+           sizeof(LockInfo) * core.len);  // UNLCK and NULL is zero
+    // close core.fd when process exits
+    return 0;
+}
+
+// Take in up to GROW_CHUNK of the records appended to preorderRecord since
+// it was last read: only they are read, the arrays grow geometrically, and
+// the lock table and the mapping are extended in place. Nothing is
+// published until all of that worked. growTimer takes in the rest and
+// indexes them, one chunk a tick. Returns the number of new records, 0 if
+// there are none, -1 on error.
+static int growRecords() {
+    int added = growCsieMask(&core, GROW_CHUNK, extendRecords, NULL);
+    if (added > 0 && !timerArmed(&growTimer))
+        armTimer(&growTimer, 1);
 #ifndef NDEBUG
-        fprintf(stderr, "owner is %p, current request is %p\n",
-                lockInfo[idx].owner, req);
+    if (added > 0)
+        fprintf(stderr, "%d record(s) appended to %s\n", added, recordPath);
 #endif
-        return LOCKED;
+    return added;
+}
+
+// a chunk of an append at a time, the clients are served in between
+static void onGrowTimer(Timer* timer) {
+    int added = growRecords();
+    int left = indexCsieMask(&core, GROW_CHUNK);
+    if (left < 0)
+        perror("indexing the records appended");  // they are still scanned
+    if (added > 0 || left > 0)
+        armTimer(timer, 1);
+}
+
+// growRecords(): what this process keeps beside core.orders for each
+// record, up to len
+static int extendRecords(CsieMask* db, int len, void* arg) {
+    (void)arg;
+    if (db->cap > lockInfoCap) {
+        int cap = db->cap;
+        LockInfo* locks = (LockInfo*)realloc(lockInfo, sizeof(LockInfo) * cap);
+        if (locks == NULL)
+            return -1;
+        lockInfo = locks;
+        if (pendingOrders) {
+            PendingOrder* pending = (PendingOrder*)realloc(
+                pendingOrders, sizeof(PendingOrder) * (cap + 1));
+            if (pending == NULL)
+                return -1;
+            pendingOrders = pending;
+        }
+        if (walBuf) {
+            WalEntry* entries =
+                (WalEntry*)realloc(walBuf, sizeof(WalEntry) * (cap + 1));
+            if (entries == NULL)
+                return -1;
+            walBuf = entries;
+        }
+        if (reserveInventory(&inventory, cap) < 0)
+            return -1;
+        lockInfoCap = cap;
+    }
+    if (records) {
+        size_t size = (size_t)len * sizeof(Order);
+        void* addr = mremap(records, recordsSize, size, MREMAP_MAYMOVE);
+        if (addr == MAP_FAILED)
+            return -1;
+        records = (Order*)addr;
+        recordsSize = size;
     }
+    loadStock(db->len, len);
+    memset(&lockInfo[db->len], 0, sizeof(LockInfo) * (len - db->len));
+    return 0;
+}
 
-#ifndef NDEBUG
-    fprintf(stderr, "%d/%d, %d/%d\n", orderAdult, idInfo[idx].adultMask,
-            orderChild, idInfo[idx].childrenMask);
+static int mapRecords() {
+    recordsSize = (size_t)core.len * sizeof(Order);
+    if (recordsSize == 0)
+        return 0;  // nothing to map, mmap() rejects length 0
+    void* addr = mmap(NULL, recordsSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      core.fd, 0);
+    if (addr == MAP_FAILED)
+        return -1;
+    records = (Order*)addr;
+    if (syncPolicy == SYNC_PERIODIC) {
+        clock_gettime(CLOCK_MONOTONIC, &nextSync);
+        nextSync.tv_sec += syncInterval;
+    }
+    return 0;
+}
+
+static int syncRecords() {
+    if (syncPolicy == SYNC_PERIODIC) {
+        clock_gettime(CLOCK_MONOTONIC, &nextSync);
+        nextSync.tv_sec += syncInterval;
+    }
+    return msync(records, recordsSize, MS_SYNC);
+}
+
+// milliseconds until the next periodic msync, -1 if there is none
+static int syncTimeout() {
+    if (records == NULL || syncPolicy != SYNC_PERIODIC)
+        return -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (nextSync.tv_sec - now.tv_sec) * 1000 +
+              (nextSync.tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+// pread/pwrite: workers share the file offset of core.fd
+static int readRecord(int idx, Order* order) {
+    if (ownRecords) {
+        *order = core.orders[idx];
+        return 0;
+    }
+    if (records) {
+        *order = records[idx];
+        return 0;
+    }
+    return readCsieMask(&core, idx, order);
+}
+
+// read a consistent copy of the record, LOCKED if a writer holds it
+static Result copyRecord(Request* req, int idx, Order* order) {
+    if (ownRecords) {
+#ifdef READ_SERVER
+        if (feed.ring)
+            followFeed();
 #endif
+        // only this process writes, or the feed tells of the writer's locks
+        if (lockInfo[idx].status == WRLCK) {
+            countLock(idx, -1, 0);
+            return LOCKED;
+        }
+        *order = core.orders[idx];
+        return SUCCESS;
+    }
+#ifdef READ_SERVER
+    if (core.table.slots) {
+        // seqlock: no lock is taken, retry if a writer got in between
+        uint64_t seq;
+        do {
+            if (beginSnapshotLockTable(&core.table, idx, &seq) < 0)
+                return LOCKED;
+            if (readRecord(idx, order) < 0)
+                return FAILED;
+        } while (!endSnapshotLockTable(&core.table, idx, seq));
+        return SUCCESS;
+    }
+#endif
+    if (tryAcquireReadLock(req, idx) < 0)
+        return LOCKED;
 
-    if (orderAdult > idInfo[idx].adultMask ||
-        orderChild > idInfo[idx].childrenMask ||
-        (orderAdult <= 0 && orderChild <= 0)) {
+    if (readRecord(idx, order) < 0) {
         releaseLock(req, idx);
-        // number not in range: negative / zero / too large
         return FAILED;
     }
 
-    orderBuf.id = req->id;
-    orderBuf.adultMask = idInfo[idx].adultMask - orderAdult;
-    orderBuf.childrenMask = idInfo[idx].childrenMask - orderChild;
+    if (releaseLock(req, idx) < 0)
+        return FAILED;
+    return SUCCESS;
+}
 
-    lseek(recordFd, idx * sizeof(Order), SEEK_SET);
-    do {
-        int ret = write(recordFd, &orderBuf, sizeof(Order));
-        if (ret == sizeof(Order))
-            break;
-        if (errno != EINTR) {
-            releaseLock(req, idx);
-            return FAILED;
+#ifndef READ_SERVER
+static int writeRecord(int idx, const Order* order) {
+    if (wal.path) {
+        walBuf[0] = (WalEntry){.idx = idx,
+                               .id = order->id,
+                               .adultMask = order->adultMask,
+                               .childrenMask = order->childrenMask};
+        return logRecords(1);
+    }
+    if (records) {
+        if (core.table.slots) {
+            beginUpdateLockTable(&core.table, idx);
+            records[idx] = *order;
+            endUpdateLockTable(&core.table, idx);
+        } else {
+            records[idx] = *order;
         }
-    } while (1);
+        storeRecord(idx, order);
+        if (syncPolicy != SYNC_WRITE)
+            return 0;
+        return msyncRecords(idx, idx);
+    }
+    if (writeCsieMask(&core, idx, order) < 0)
+        return -1;
+    storeRecord(idx, order);
+    return 0;
+}
+#endif
 
-    if (releaseLock(req, idx) < 0)
-        return FAILED;
+// sync the pages of the mapping holding records first..last
+static int msyncRecords(int first, int last) {
+    // msync() wants a page aligned address
+    static long pageSize = 0;
+    if (pageSize == 0)
+        pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)&records[first] & ~(uintptr_t)(pageSize - 1);
+    uintptr_t end = (uintptr_t)&records[last + 1];
+    return msync((void*)start, end - start, MS_SYNC);
+}
 
-    if (orderAdult) {
-        sprintf(buf, "Pre-order for %d successed, %d adult mask(s) ordered.\n",
-                req->id, orderAdult);
+// a record this process wrote or applied: core.orders and the stock columns
+// take it, with -r the replicas are told
+static void storeRecord(int idx, const Order* order) {
+    core.orders[idx] = *order;
+    inventory.ids[idx] = abs(order->id);
+    inventory.stock[0][idx] = order->adultMask;
+    inventory.stock[1][idx] = order->childrenMask;
+    if (feed.writer)
+        publishFeed(&feed, FEED_RECORD, idx, order->id, order->adultMask,
+                    order->childrenMask);
+}
 
-    } else {
-        sprintf(buf,
-                "Pre-order for %d successed, %d children mask(s) ordered.\n",
-                req->id, orderChild);
+// copy core.orders[first..last) to the stock columns
+static void loadStock(int first, int last) {
+    for (int i = first; i < last; ++i) {
+        inventory.ids[i] = abs(core.orders[i].id);
+        inventory.stock[0][i] = core.orders[i].adultMask;
+        inventory.stock[1][i] = core.orders[i].childrenMask;
     }
-    write(req->conn_fd, buf, strlen(buf));
-    return SUCCESS;
+    inventory.len = last > inventory.len ? last : inventory.len;
 }
 
-static int initializeIdInfo() {
-    do {
-        recordFd = open("./preorderRecord", O_RDWR);
-        if (recordFd >= 0)
-            break;
-        if (errno != EINTR)
-            return -1;
-    } while (1);
+// Before a report: unless this process owns the records, other servers may
+// have written the file since, so the columns are read from it again. That
+// is a pass over the whole file, done at most every STOCK_REFRESH_MS; the
+// writes of this process are in the columns at once.
+static int refreshStock() {
+    static long refreshedMs = -1;
+    if (ownRecords)
+        return 0;
+    long now = nowMs();
+    if (refreshedMs >= 0 && now - refreshedMs < STOCK_REFRESH_MS)
+        return 0;
+    if (growRecords() < 0)
+        return -1;
+    static Order chunk[SNAPSHOT_CHUNK];
+    for (int first = 0; first < core.len; first += SNAPSHOT_CHUNK) {
+        int n = core.len - first < SNAPSHOT_CHUNK ? core.len - first
+                                                   : SNAPSHOT_CHUNK;
+        const Order* from = records ? &records[first] : chunk;
+        if (records == NULL) {
+            off_t offset = (off_t)first * sizeof(Order);
+            char* bufPtr = (char*)chunk;
+            for (size_t count = n * sizeof(Order); count;) {
+                ssize_t ret = pread(core.fd, bufPtr, count, offset);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret <= 0)
+                    return -1;
+                count -= ret;
+                bufPtr += ret;
+                offset += ret;
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            inventory.ids[first + i] = abs(from[i].id);
+            inventory.stock[0][first + i] = from[i].adultMask;
+            inventory.stock[1][first + i] = from[i].childrenMask;
+        }
+    }
+    refreshedMs = now;
+    return 0;
+}
 
-    if (recordFd < 0)
-        ERR_EXIT("failed to open ./preorderRecord");
-    // acquire read lock on whole file
-    acquireLockBlocking(recordFd, F_RDLCK, SEEK_SET, 0, 0);
-    size_t nBytes = getFileSize(recordFd);
-    idInfoLen = nBytes / sizeof(Order);
-    idInfo = (Order*)malloc(sizeof(Order) * idInfoLen);
-    if (safeRead(recordFd, (char*)idInfo, nBytes) < 0)
-        ERR_EXIT("failed to read file");
-
-    lockInfo = (LockInfo*)malloc(sizeof(LockInfo) * idInfoLen);
-    memset(lockInfo, 0,
-           sizeof(LockInfo) * idInfoLen);  // UNLCK and NULL is zero
-    // release read lock on whole file
-    acquireLockBlocking(recordFd, F_UNLCK, SEEK_SET, 0, 0);
-    // close recordFd when process exits
+static int openLog() {
+    logPath = (char*)malloc(strlen(recordPath) + sizeof(".wal"));
+    walBuf = (WalEntry*)malloc(sizeof(WalEntry) * (lockInfoCap + 1));
+    if (logPath == NULL || walBuf == NULL)
+        return -1;
+    sprintf(logPath, "%s.wal", recordPath);
+    if (openWal(&wal, logPath) < 0)
+        return -1;
+    uint64_t start = nowNs();
+    long n = replayWal(&wal, core.len, applyLogEntry, NULL);
+    if (n < 0)
+        return -1;
+    if (n == 0)
+        return 0;
+    // let read_server see the orders it missed
+    if (writeSnapshot() < 0 || compactWal(&wal, wal.nextLsn - 1) < 0)
+        return -1;
+    fprintf(stderr, "recovered %ld order(s) from %s in %.1f ms\n", n,
+            logPath, (nowNs() - start) / 1e6);
     return 0;
 }
 
-static int getIndexOfId(int id) {
-    for (int i = 0; i < idInfoLen; ++i) {
-        if (abs(idInfo[i].id) == id) {
-            return i;
+// leave preorderRecord up to date and the log empty
+static void closeLog() {
+    if (compactPid > 0) {
+        // it may be waiting for locks held here
+        kill(compactPid, SIGKILL);
+        waitpid(compactPid, NULL, 0);
+        compactPid = 0;
+    }
+    if (walEntries(&wal) > 0 &&
+        (writeSnapshot() < 0 || compactWal(&wal, wal.nextLsn - 1) < 0))
+        fprintf(stderr, "failed to write a snapshot, %s is kept: %s\n",
+                logPath, strerror(errno));
+    closeWal(&wal);
+}
+
+static void applyLogEntry(const WalEntry* entry, void* arg) {
+    (void)arg;
+    storeRecord(entry->idx, &(Order){.id = entry->id,
+                                     .adultMask = entry->adultMask,
+                                     .childrenMask = entry->childrenMask});
+}
+
+// append walBuf[0..n) with one write, then apply it to core.orders
+static int logRecords(int n) {
+    if (appendWal(&wal, walBuf, n) < 0)
+        return -1;
+    for (int i = 0; i < n; ++i)
+        applyLogEntry(&walBuf[i], NULL);
+    if (compactPid == 0 && walEntries(&wal) >= (uint64_t)compactEvery)
+        startCompaction();
+    return 0;
+}
+
+// Write core.orders over preorderRecord in place, read_server keeps its
+// descriptor and mapping, and sync it. Readers are kept out of one chunk at
+// a time, with the seqlock under -l and an fcntl write lock otherwise; in
+// the compaction child the latter also waits for the clients of this
+// server that hold a record.
+static int writeSnapshot() {
+    int ret = 0;
+    for (int first = 0; first < core.len && ret == 0;
+         first += SNAPSHOT_CHUNK) {
+        int len = core.len - first < SNAPSHOT_CHUNK ? core.len - first
+                                                     : SNAPSHOT_CHUNK;
+        off_t offset = (off_t)first * sizeof(Order);
+        size_t count = len * sizeof(Order);
+        if (core.table.slots)
+            for (int i = first; i < first + len; ++i)
+                beginUpdateLockTable(&core.table, i);
+        else if (acquireLockBlocking(core.fd, F_WRLCK, SEEK_SET, offset,
+                                     count) < 0)
+            return -1;
+        const char* bufPtr = (const char*)&core.orders[first];
+        for (off_t at = offset; count > 0;) {
+            ssize_t n = pwrite(core.fd, bufPtr, count, at);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                ret = -1;
+                break;
+            }
+            bufPtr += n;
+            count -= n;
+            at += n;
         }
+        if (core.table.slots)
+            for (int i = first; i < first + len; ++i)
+                endUpdateLockTable(&core.table, i);
+        else
+            acquireLockBlocking(core.fd, F_UNLCK, SEEK_SET, offset,
+                                len * sizeof(Order));
     }
-    return -1;
+    return ret < 0 ? -1 : fdatasync(core.fd);
 }
 
-static ssize_t safeRead(int fd, char* buf, size_t count) {
-    char* bufPtr = buf;
-    int ret;
+// fork a child to write the snapshot as of now, the log is cut when it is
+// done; core.orders is its copy-on-write view of the records
+static void startCompaction() {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");  // tried again on the next order
+        return;
+    }
+    if (pid == 0) {
+        // clients must see their connection close when this server does
+        if (core.fd > 3)
+            close_range(3, core.fd - 1, 0);
+        close_range(core.fd + 1, ~0U, 0);
+        _exit(writeSnapshot() < 0 ? 1 : 0);
+    }
+    compactPid = pid;
+    compactLsn = wal.nextLsn - 1;
+}
+
+// drop what the child wrote from the log once it is done
+static void reapCompaction(bool wait) {
+    int status;
+    pid_t pid;
+    do {
+        pid = waitpid(compactPid, &status, wait ? 0 : WNOHANG);
+    } while (pid < 0 && errno == EINTR);
+    if (pid == 0)
+        return;  // still writing
+    compactPid = 0;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "failed to write a snapshot, %s is kept\n", logPath);
+        return;
+    }
+    if (compactWal(&wal, compactLsn) < 0)
+        fprintf(stderr, "failed to compact %s: %s\n", logPath,
+                strerror(errno));
+#ifndef NDEBUG
+    fprintf(stderr, "snapshot up to order %llu written\n",
+            (unsigned long long)compactLsn);
+#endif
+}
+
+// -r replica: apply what the writer published since the last call
+static void followFeed() {
+    FeedEntry entries[FEED_BATCH];
+    int n;
+    while ((n = readFeed(&feed, entries, FEED_BATCH)) != 0) {
+        if (n < 0) {
+            // lapped, the entries in between are gone
+            ++metrics.feedResyncs;
+            if (resyncReplica() < 0) {
+                perror("failed to copy the records");
+                return;  // try again with the next lookup
+            }
+            continue;
+        }
+        uint64_t now = nowNs();
+        for (int i = 0; i < n; ++i) {
+            const FeedEntry* entry = &entries[i];
+            recordHistogram(&metrics.feedLag,
+                            now > entry->stamp ? now - entry->stamp : 0);
+            if (entry->kind == FEED_RESET) {
+                unlockFeedRecords();
+                continue;
+            }
+            while (entry->idx >= core.len && growRecords() > 0)
+                ;  // appended to the file since
+            if (entry->idx < 0 || entry->idx >= core.len)
+                continue;
+            LockInfo* info = &lockInfo[entry->idx];
+            if (entry->kind == FEED_RECORD) {
+                storeRecord(entry->idx,
+                            &(Order){.id = entry->id,
+                                     .adultMask = entry->adultMask,
+                                     .childrenMask = entry->childrenMask});
+            } else if (entry->kind == FEED_LOCK && info->status != WRLCK) {
+                info->status = WRLCK;
+                ++feedLocked;
+            } else if (entry->kind == FEED_UNLOCK && info->status == WRLCK) {
+                info->status = UNLCK;
+                --feedLocked;
+            }
+        }
+        metrics.feedApplied += n;
+    }
+}
+
+// -r replica: copy the records from the file, then follow the feed from
+// where it was before the copy; what was published meanwhile is applied
+// again. The locks of the entries missed are forgotten.
+static int resyncReplica() {
+    uint64_t head = headOfFeed(&feed);
+    off_t offset = 0;
+    char* bufPtr = (char*)core.orders;
+    size_t count = (size_t)core.len * sizeof(Order);
     while (count) {
-        ret = read(fd, bufPtr, count);
-        if (ret >= 0) {
+        ssize_t ret = pread(core.fd, bufPtr, count, offset);
+        if (ret > 0) {
             count -= ret;
             bufPtr += ret;
-        } else if (errno != EINTR)
+            offset += ret;
+        } else if (ret == 0 || errno != EINTR) {
             return -1;
+        }
     }
-    return ret;
+    feed.next = head;
+    loadStock(0, core.len);
+    unlockFeedRecords();
+    return 0;
+}
+
+static void unlockFeedRecords() {
+    for (int idx = 0; feedLocked > 0 && idx < core.len; ++idx)
+        if (lockInfo[idx].status == WRLCK) {
+            lockInfo[idx].status = UNLCK;
+            --feedLocked;
+        }
+}
+
+static void onFeedTimer(Timer* timer) {
+    followFeed();
+    if (feedLocked > 0 && !writerOfFeedAlive(&feed))
+        unlockFeedRecords();  // they died with the writer
+    armTimer(timer, FEED_POLL_MS);
+}
+
+// An unknown id may be in records appended since, look for them first. The
+// file is checked at most once per tick of timers: a client sending unknown
+// ids must not cost an fstat() each.
+static int getIndexOfId(int id) {
+    static unsigned long checkedTick = -1;
+    int idx = indexOfCsieMask(&core, id);
+    if (idx < 0 && checkedTick != timers.now) {
+        checkedTick = timers.now;
+        if (growRecords() > 0)
+            idx = indexOfCsieMask(&core, id);
+    }
+    return idx;
 }
 
 static int acquireLockBlocking(int fd, short type, short whence, off_t offset,
@@ -564,24 +3478,33 @@ static int acquireLockBlocking(int fd, short type, short whence, off_t offset,
     return ret;
 }
 
-static int acquireLock(int fd, short type, short whence, off_t offset,
-                       off_t len) {
-    struct flock lock = {
-        .l_type = type, .l_whence = whence, .l_start = offset, .l_len = len
-        // omit l_pid
-    };
-    return fcntl(fd, F_SETLK, &lock);
+// a lock attempt on the record of idx, ret as the attempt returned, taking
+// ns nanoseconds, 0 if it was not timed
+static void countLock(int idx, int ret, uint64_t ns) {
+    if (ret == 0) {
+        ++lockInfo[idx].acquired;
+        ++metrics.lockAcquired;
+    } else {
+        ++lockInfo[idx].failed;
+        ++metrics.lockFailed;
+    }
+    if (ns)
+        recordHistogram(&metrics.lockWait, ns);
 }
 
 static int tryAcquireReadLock(Request* req, int idx) {
     if (lockInfo[idx].status == WRLCK) {
+        countLock(idx, -1, 0);
         return -1;
     }
-    int ret = acquireLock(recordFd, F_RDLCK, SEEK_SET, idx * sizeof(Order),
-                          sizeof(Order));
+    uint64_t start = startSample();
+    int ret = lockCsieMask(&core, idx, false, false);
+    countLock(idx, ret, start ? nowNs() - start : 0);
     if (ret == 0) {
         lockInfo[idx].status = RDLCK;
         lockInfo[idx].owner = req;
+        if (lockTimeout)
+            armTimer(&req->lockTimer, lockTimeout);
 #ifndef NDEBUG
         fprintf(stderr, "read lock[%d] acquired\n", idx);
 #endif
@@ -591,13 +3514,19 @@ static int tryAcquireReadLock(Request* req, int idx) {
 
 static int tryAcquireWriteLock(Request* req, int idx) {
     if (lockInfo[idx].status == WRLCK) {
+        countLock(idx, -1, 0);
         return -1;
     }
-    int ret = acquireLock(recordFd, F_WRLCK, SEEK_SET, idx * sizeof(Order),
-                          sizeof(Order));
+    uint64_t start = startSample();
+    int ret = lockCsieMask(&core, idx, true, lockInfo[idx].status == RDLCK);
+    countLock(idx, ret, start ? nowNs() - start : 0);
     if (ret == 0) {
+        if (feed.writer)
+            publishFeed(&feed, FEED_LOCK, idx, 0, 0, 0);
         lockInfo[idx].status = WRLCK;
         lockInfo[idx].owner = req;
+        if (lockTimeout)
+            armTimer(&req->lockTimer, lockTimeout);
 #ifndef NDEBUG
         fprintf(stderr, "write lock[%d] acquired\n", idx);
 #endif
@@ -611,9 +3540,11 @@ static int releaseLock(Request* req, int idx) {
     } else if (lockInfo[idx].owner != req) {
         return -1;
     }
-    int ret = acquireLock(recordFd, F_UNLCK, SEEK_SET, idx * sizeof(Order),
-                          sizeof(Order));
+    int ret = unlockCsieMask(&core, idx, lockInfo[idx].status == WRLCK);
     if (ret == 0) {
+        if (feed.writer && lockInfo[idx].status == WRLCK)
+            publishFeed(&feed, FEED_UNLOCK, idx, 0, 0, 0);
+        delTimer(&timers, &req->lockTimer);
         lockInfo[idx].status = UNLCK;
         lockInfo[idx].owner = NULL;
 #ifndef NDEBUG
@@ -622,12 +3553,3 @@ static int releaseLock(Request* req, int idx) {
     }
     return ret;
 }
-
-static off_t getFileSize(int fd) {
-    static struct stat status;
-    if (fstat(fd, &status) < 0) {
-        ERR_EXIT("failed to get file size");
-        return 0;
-    }
-    return status.st_size;
-}
\ No newline at end of file
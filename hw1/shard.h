@@ -0,0 +1,15 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+// Id-range sharding: the ids first..first+count-1 are split into shards
+// ranges of about the same size, shard k holding the k-th. splitrecords
+// writes the records of shard k to file.k, a read_server/write_server group
+// serves each with -f, and clients send an id to the group of its shard
+// (loadgen -s).
+static inline int shardOfId(int id, int first, int count, int shards) {
+    return (int)((int64_t)(id - first) * shards / count);
+}
+
+#endif
@@ -0,0 +1,89 @@
+// Split a record file into id-range shards, e.g.
+//   ./splitrecords 4 preorderRecord
+// writes preorderRecord.0 .. preorderRecord.3, shard.h says which ids go to
+// which file. Records keep their order within a shard. Each line printed is
+// a shard and its ids; -i and -n for loadgen -s are on the last one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shard.h"
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+typedef struct {
+    int id;
+    int adultMask;
+    int childrenMask;
+} Order;
+
+int main(int argc, char* argv[]) {
+    int shards = argc >= 2 ? atoi(argv[1]) : 0;
+    if (argc < 2 || argc > 3 || shards <= 0) {
+        fprintf(stderr, "usage: %s shards [file]\n", argv[0]);
+        exit(1);
+    }
+    const char* path = argc == 3 ? argv[2] : "preorderRecord";
+
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+        ERR_EXIT(path);
+    size_t len = 0, cap = 1024;
+    Order* orders = (Order*)malloc(sizeof(Order) * cap);
+    while (orders && fread(&orders[len], sizeof(Order), 1, in) == 1)
+        if (++len == cap)
+            orders = (Order*)realloc(orders, sizeof(Order) * (cap *= 2));
+    if (orders == NULL)
+        ERR_EXIT("malloc");
+    if (ferror(in))
+        ERR_EXIT(path);
+    fclose(in);
+    if (len == 0) {
+        fprintf(stderr, "%s has no records\n", path);
+        exit(1);
+    }
+
+    int minId = abs(orders[0].id), maxId = minId;
+    for (size_t i = 1; i < len; ++i) {
+        int id = abs(orders[i].id);
+        minId = id < minId ? id : minId;
+        maxId = id > maxId ? id : maxId;
+    }
+    int count = maxId - minId + 1;
+    char* name = (char*)malloc(strlen(path) + 16);
+    FILE** out = (FILE**)malloc(sizeof(FILE*) * shards);
+    size_t* n = (size_t*)calloc(shards, sizeof(size_t));
+    if (name == NULL || out == NULL || n == NULL)
+        ERR_EXIT("malloc");
+    for (int k = 0; k < shards; ++k) {
+        sprintf(name, "%s.%d", path, k);
+        if ((out[k] = fopen(name, "wb")) == NULL)
+            ERR_EXIT(name);
+    }
+    for (size_t i = 0; i < len; ++i) {
+        int k = shardOfId(abs(orders[i].id), minId, count, shards);
+        if (fwrite(&orders[i], sizeof(Order), 1, out[k]) != 1)
+            ERR_EXIT("fwrite");
+        ++n[k];
+    }
+    for (int k = 0; k < shards; ++k) {
+        sprintf(name, "%s.%d", path, k);
+        if (fclose(out[k]) != 0)
+            ERR_EXIT(name);
+        // the ids of shard k, the inverse of shardOfId()
+        long first = minId + ((long)k * count + shards - 1) / shards;
+        long last = minId + ((long)(k + 1) * count + shards - 1) / shards - 1;
+        printf("%s ids %ld-%ld records %zu\n", name, first, last, n[k]);
+    }
+    printf("loadgen -s %d -i %d -n %d\n", shards, minId, count);
+    free(orders);
+    free(name);
+    free(out);
+    free(n);
+    return 0;
+}
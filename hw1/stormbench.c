@@ -0,0 +1,186 @@
+// Open a burst of connections to a csieMask server at once and time how long
+// the server takes to greet all of them, e.g.
+//   ./stormbench -c 10000 -k 4 localhost 3333
+// A client is served when it gets the id prompt, shed when it gets
+// "Operation failed." or is closed without one, and failed when its
+// connection is refused or reset. Served clients hang up at once so that a
+// server running with -c can take the next ones, unless -H holds them open.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR_EXIT(a) \
+    do {            \
+        perror(a);  \
+        exit(1);    \
+    } while (0)
+
+typedef enum { WAITING, SERVED, SHED, FAILED } Outcome;
+
+static struct sockaddr_in svrAddr;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int connectFrom(int srcIdx) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        ERR_EXIT("socket");
+    if (srcIdx > 0) {
+        struct sockaddr_in src = {.sin_family = AF_INET, .sin_port = 0};
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + srcIdx);
+        if (bind(fd, (struct sockaddr*)&src, sizeof(src)) < 0)
+            ERR_EXIT("bind");
+    }
+    if (connect(fd, (struct sockaddr*)&svrAddr, sizeof(svrAddr)) < 0 &&
+        errno != EINPROGRESS)
+        ERR_EXIT("connect");
+    return fd;
+}
+
+// what the first reply of the server says about the client
+static Outcome readOutcome(int fd) {
+    char buf[512];
+    int ret = read(fd, buf, sizeof(buf) - 1);
+    if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+        return WAITING;
+    if (ret < 0)
+        return errno == ECONNREFUSED || errno == ECONNRESET ? FAILED : SHED;
+    if (ret == 0)
+        return SHED;
+    buf[ret] = '\0';
+    return strstr(buf, "Please enter") ? SERVED : SHED;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[]) {
+    int nConn = 1000, nSrc = 1, hold = 0, opt;
+    double limit = 10;
+    while ((opt = getopt(argc, argv, "c:k:t:H")) != -1) {
+        switch (opt) {
+        case 'c':
+            nConn = atoi(optarg);
+            break;
+        case 'k':
+            nSrc = atoi(optarg);
+            break;
+        case 't':
+            limit = atof(optarg);
+            break;
+        case 'H':
+            hold = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2 || nConn <= 0 || nSrc <= 0 || limit <= 0) {
+    usage:
+        fprintf(stderr,
+                "usage: %s [-c conns] [-k sources] [-t seconds] [-H] host "
+                "port\n",
+                argv[0]);
+        exit(1);
+    }
+
+    struct hostent* host = gethostbyname(argv[optind]);
+    if (host == NULL) {
+        fprintf(stderr, "unknown host %s\n", argv[optind]);
+        exit(1);
+    }
+    svrAddr.sin_family = AF_INET;
+    svrAddr.sin_port = htons(atoi(argv[optind + 1]));
+    memcpy(&svrAddr.sin_addr, host->h_addr_list[0], host->h_length);
+
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    int epollFd = epoll_create1(0);
+    if (epollFd < 0)
+        ERR_EXIT("epoll_create1");
+    int* fds = (int*)malloc(sizeof(int) * nConn);
+    double* lat = (double*)malloc(sizeof(double) * nConn);
+    struct epoll_event* events =
+        (struct epoll_event*)malloc(sizeof(struct epoll_event) * 1024);
+    if (!fds || !lat || !events)
+        ERR_EXIT("malloc");
+
+    // the whole burst goes out before any reply is read
+    double start = now();
+    for (int i = 0; i < nConn; ++i) {
+        fds[i] = connectFrom(nSrc > 1 ? i % nSrc : 0);
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP,
+                                 .data.u32 = i};
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+            ERR_EXIT("epoll_ctl");
+    }
+    double sent = now() - start;
+
+    int count[4] = {nConn, 0, 0, 0}, nLat = 0;
+    double last = start;
+    while (count[WAITING] > 0) {
+        int ms = (int)((start + limit - now()) * 1000);
+        if (ms <= 0)
+            break;
+        int n = epoll_wait(epollFd, events, 1024, ms);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            ERR_EXIT("epoll_wait");
+        double t = now();
+        for (int j = 0; j < n; ++j) {
+            int i = events[j].data.u32;
+            Outcome res = readOutcome(fds[i]);
+            if (res == WAITING)
+                continue;
+            --count[WAITING];
+            ++count[res];
+            last = t;
+            if (res == SERVED)
+                lat[nLat++] = t - start;
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fds[i], NULL);
+            if (!hold || res != SERVED) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+    }
+    qsort(lat, nLat, sizeof(double), cmpDouble);
+
+    printf("conns=%d served=%d shed=%d failed=%d waiting=%d connect=%.1fms "
+           "all=%.1fms",
+           nConn, count[SERVED], count[SHED], count[FAILED], count[WAITING],
+           sent * 1e3, (last - start) * 1e3);
+    if (nLat > 0)
+        printf(" p50=%.1fms p99=%.1fms max=%.1fms", lat[nLat / 2] * 1e3,
+               lat[nLat * 99 / 100] * 1e3, lat[nLat - 1] * 1e3);
+    printf("\n");
+
+    for (int i = 0; i < nConn; ++i)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    close(epollFd);
+    free(fds);
+    free(lat);
+    free(events);
+    return 0;
+}
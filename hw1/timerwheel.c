@@ -0,0 +1,135 @@
+#include "timerwheel.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define MAX_DELAY ((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+void initTimerWheel(TimerWheel* wheel, unsigned long now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        wheel->occupied[level] = 0;
+        for (int i = 0; i < WHEEL_SIZE; ++i)
+            wheel->slots[level][i].next = wheel->slots[level][i].prev =
+                &wheel->slots[level][i];
+    }
+}
+
+void initTimer(Timer* timer, void (*callback)(Timer*)) {
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+}
+
+static void placeTimer(TimerWheel* wheel, Timer* timer) {
+    unsigned long delta = timer->expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= 1UL << (WHEEL_BITS * (level + 1)))
+        ++level;
+    int idx = (timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer* head = &wheel->slots[level][idx];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->occupied[level] |= 1ULL << idx;
+}
+
+static void unlinkTimer(TimerWheel* wheel, Timer* timer) {
+    Timer* next = timer->next;
+    timer->prev->next = next;
+    next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    if (next->next == next) {
+        // the slot is empty now, next is its head
+        ptrdiff_t slot = next - &wheel->slots[0][0];
+        wheel->occupied[slot / WHEEL_SIZE] &= ~(1ULL << slot % WHEEL_SIZE);
+    }
+}
+
+void addTimer(TimerWheel* wheel, Timer* timer, unsigned long now,
+              unsigned long delay) {
+    if (timerArmed(timer))
+        delTimer(wheel, timer);
+    // runTimers() skips no ticks while there are timers, an idle wheel may
+    // have fallen behind
+    if (wheel->count == 0 && (long)(now - wheel->now) > 0)
+        wheel->now = now;
+    timer->expires = now + delay;
+    long delta = (long)(timer->expires - wheel->now);
+    if (delta < 0)
+        timer->expires = wheel->now;  // due already, runs on the next tick
+    else if ((unsigned long)delta > MAX_DELAY)
+        timer->expires = wheel->now + MAX_DELAY;
+    placeTimer(wheel, timer);
+    ++wheel->count;
+}
+
+void delTimer(TimerWheel* wheel, Timer* timer) {
+    if (!timerArmed(timer))
+        return;
+    unlinkTimer(wheel, timer);
+    --wheel->count;
+}
+
+// move the timers of a slot down to the levels below
+static void cascade(TimerWheel* wheel, int level, int idx) {
+    Timer* head = &wheel->slots[level][idx];
+    if (head->next == head)
+        return;
+    // detach the list first, a timer a whole turn ahead lands here again
+    Timer* timer = head->next;
+    head->prev->next = NULL;
+    head->next = head->prev = head;
+    wheel->occupied[level] &= ~(1ULL << idx);
+    while (timer) {
+        Timer* next = timer->next;
+        placeTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+void runTimers(TimerWheel* wheel, unsigned long now) {
+    while ((long)(now - wheel->now) >= 0) {
+        if (wheel->count == 0) {
+            wheel->now = now + 1;
+            return;
+        }
+        int idx = wheel->now & WHEEL_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < WHEEL_LEVELS; ++level) {
+                int upper = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+                cascade(wheel, level, upper);
+                if (upper != 0)
+                    break;
+            }
+        }
+        Timer* head = &wheel->slots[0][idx];
+        while (head->next != head) {
+            // callbacks may add or delete timers, take them one by one
+            Timer* timer = head->next;
+            unlinkTimer(wheel, timer);
+            --wheel->count;
+            timer->callback(timer);
+        }
+        ++wheel->now;
+    }
+}
+
+long nextTimer(const TimerWheel* wheel, unsigned long now) {
+    if (wheel->count == 0)
+        return -1;
+    int idx = wheel->now & WHEEL_MASK;
+    uint64_t pending = wheel->occupied[0];
+    unsigned long due;
+    if (pending) {
+        // rotate so that bit 0 is the next slot to run
+        uint64_t rotated = idx ? pending >> idx | pending << (WHEEL_SIZE - idx)
+                               : pending;
+        due = wheel->now + __builtin_ctzll(rotated);
+    } else {
+        // nothing on level 0, wake up for the next cascade
+        due = wheel->now + ((WHEEL_SIZE - idx) & WHEEL_MASK);
+    }
+    return (long)(due - now) > 0 ? (long)(due - now) : 0;
+}
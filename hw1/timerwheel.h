@@ -0,0 +1,44 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timing wheel: 4 levels of 64 slots, one tick per millisecond
+// on level 0, so a timer can be up to 64^4 ticks (~4.6 hours) ahead.
+// Adding, removing and finding the next deadline are O(1); a level is
+// cascaded into the one below every 64 ticks of that lower level.
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct Timer {
+    struct Timer *next, *prev;  // NULL when not armed
+    unsigned long expires;      // tick
+    void (*callback)(struct Timer*);
+} Timer;
+
+typedef struct {
+    unsigned long now;  // next tick to run
+    long count;         // armed timers
+    uint64_t occupied[WHEEL_LEVELS];  // bit i: slot i is not empty
+    Timer slots[WHEEL_LEVELS][WHEEL_SIZE];  // list heads
+} TimerWheel;
+
+void initTimerWheel(TimerWheel* wheel, unsigned long now);
+void initTimer(Timer* timer, void (*callback)(Timer*));
+// (re)arm the timer to fire delay ticks after now
+void addTimer(TimerWheel* wheel, Timer* timer, unsigned long now,
+              unsigned long delay);
+void delTimer(TimerWheel* wheel, Timer* timer);
+// run every timer due up to tick now
+void runTimers(TimerWheel* wheel, unsigned long now);
+// ticks from now until the next timer may be due, -1 if there is none
+long nextTimer(const TimerWheel* wheel, unsigned long now);
+
+static inline bool timerArmed(const Timer* timer) {
+    return timer->next != NULL;
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int setupUring(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int enterUring(int fd, unsigned submit, unsigned wait, unsigned flags,
+                      const void* arg, size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg,
+                        argSize);
+}
+
+int initUring(Uring* ring, unsigned entries, unsigned flags) {
+    struct io_uring_params params;
+    int fd;
+    // the hints came one kernel at a time: drop them together if refused
+    for (;;) {
+        memset(&params, 0, sizeof(params));
+        params.flags = flags | IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        fd = setupUring(entries, &params);
+        if (fd >= 0 || errno != EINVAL || flags == 0)
+            break;
+        flags = 0;
+    }
+    if (fd < 0)
+        return -1;
+    if (!(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_SUBMIT_STABLE) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        // lost completions, or iovecs that must outlive the submission
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = fd;
+    ring->features = params.features;
+    ring->sqRingSize =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = 0;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqRing = ring->sqRing;
+    if (ring->sqRing != MAP_FAILED && ring->cqRingSize != 0)
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe*)mmap(
+        NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED ||
+        ring->sqes == MAP_FAILED) {
+        int err = errno;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        if (ring->cqRing == MAP_FAILED)
+            ring->cqRing = NULL;
+        if (ring->sqRing == MAP_FAILED)
+            ring->sqRing = ring->cqRing = NULL;
+        freeUring(ring);
+        errno = err;
+        return -1;
+    }
+
+    char* sq = (char*)ring->sqRing;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    ring->sqTaken = *ring->sqTail;
+    char* cq = (char*)ring->cqRing;
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    // slot i of the array always names SQE i, they are taken in order
+    for (unsigned i = 0; i < ring->sqEntries; ++i)
+        ring->sqArray[i] = i;
+    return 0;
+}
+
+void freeUring(Uring* ring) {
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing != NULL)
+        munmap(ring->sqRing, ring->sqRingSize);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* getSqe(Uring* ring) {
+    unsigned tail = ring->sqTaken;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+           ring->sqEntries) {
+        // full: hand what is queued over, completions can wait for later
+        if (submitUring(ring, 0, 0) < 0)
+            return NULL;
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqTaken = tail + 1;
+    ++ring->sqPending;
+    return sqe;
+}
+
+int submitUring(Uring* ring, unsigned wait, int timeout) {
+    struct __kernel_timespec ts = {.tv_sec = timeout / 1000,
+                                   .tv_nsec = timeout % 1000 * 1000000L};
+    struct io_uring_getevents_arg arg = {.ts = timeout < 0 ? 0 : (uint64_t)&ts};
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout == 0)
+        wait = 0;
+    // the SQEs taken are filled in by now, the kernel may read them
+    __atomic_store_n(ring->sqTail, ring->sqTaken, __ATOMIC_RELEASE);
+    int n = enterUring(ring->fd, ring->sqPending, wait, flags, &arg,
+                       sizeof(arg));
+    if (n < 0)
+        return errno == ETIME || errno == EINTR ? 0 : -1;
+    ring->sqPending -= (unsigned)n < ring->sqPending ? (unsigned)n
+                                                      : ring->sqPending;
+    return 0;
+}
+
+struct io_uring_cqe* peekCqe(Uring* ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void seenCqe(Uring* ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+int registerUring(Uring* ring, unsigned opcode, const void* arg,
+                  unsigned nrArgs) {
+    return (int)syscall(__NR_io_uring_register, ring->fd, opcode, arg,
+                        nrArgs);
+}
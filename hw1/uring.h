@@ -0,0 +1,46 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bare io_uring on the raw system calls, there is no liburing to link: the
+// submission and completion queues are mapped and driven directly.
+// SQEs taken with getSqe() reach the kernel with the next submitUring(), or
+// earlier when the submission queue fills up: the tail the kernel reads is
+// only moved then, once the caller has filled them in.
+typedef struct {
+    int fd;  // -1 when not set up
+    unsigned features;  // IORING_FEAT_*
+    // submission queue
+    unsigned *sqHead, *sqTail, *sqArray;
+    unsigned sqMask, sqEntries;
+    unsigned sqTaken;    // tail past the SQEs taken, *sqTail lags behind
+    unsigned sqPending;  // taken since the last submission
+    struct io_uring_sqe* sqes;
+    // completion queue
+    unsigned *cqHead, *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+} Uring;
+
+// entries SQEs and 4 times as many CQEs, flags are IORING_SETUP_* hints that
+// are dropped if the kernel does not know them
+int initUring(Uring* ring, unsigned entries, unsigned flags);
+void freeUring(Uring* ring);
+// a zeroed SQE; a full queue is submitted first, NULL if that fails
+struct io_uring_sqe* getSqe(Uring* ring);
+// Submit what was queued and wait until wait completions are ready or
+// timeout ms passed, -1 to wait without limit. Returns 0 or -1 with errno;
+// a timeout or a signal is not an error.
+int submitUring(Uring* ring, unsigned wait, int timeout);
+// the oldest completion not seen yet, NULL if there is none
+struct io_uring_cqe* peekCqe(Uring* ring);
+void seenCqe(Uring* ring);
+int registerUring(Uring* ring, unsigned opcode, const void* arg,
+                  unsigned nrArgs);
+
+#endif
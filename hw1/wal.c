@@ -0,0 +1,257 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WAL_CHUNK 2048  // entries read or copied at a time
+
+static uint32_t crcTable[8][256];
+
+// CRC-32C (Castagnoli), slicing by 8: replay checks every entry, one table
+// lookup per byte made that most of the recovery time
+static uint32_t crc32c(const void* data, size_t len) {
+    if (crcTable[0][1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k)
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            crcTable[0][i] = crc;
+        }
+        for (int t = 1; t < 8; ++t)
+            for (int i = 0; i < 256; ++i)
+                crcTable[t][i] = crcTable[0][crcTable[t - 1][i] & 0xff] ^
+                                 (crcTable[t - 1][i] >> 8);
+    }
+    const uint8_t* p = (const uint8_t*)data;
+    uint32_t crc = ~0u;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                             (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][p[4]] ^ crcTable[2][p[5]] ^ crcTable[1][p[6]] ^
+              crcTable[0][p[7]];
+    }
+    while (len--)
+        crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int writeAllAt(int fd, const void* buf, size_t len, off_t offset) {
+    const char* p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// read up to len bytes, fewer only at the end of the file
+static ssize_t readAllAt(int fd, void* buf, size_t len, off_t offset) {
+    char* p = (char*)buf;
+    size_t have = 0;
+    while (have < len) {
+        ssize_t n = pread(fd, p + have, len - have, offset + have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        have += n;
+    }
+    return have;
+}
+
+static int writeHeader(int fd, uint64_t baseLsn) {
+    WalHeader header = {.baseLsn = baseLsn};
+    memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+    header.crc = crc32c(&header, offsetof(WalHeader, crc));
+    return writeAllAt(fd, &header, sizeof(header), 0);
+}
+
+// make a rename in the directory of path durable
+static int syncDir(const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return -1;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0)
+        return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+int openWal(Wal* wal, const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    struct stat status;
+    if (fstat(fd, &status) < 0) {
+        close(fd);
+        return -1;
+    }
+    WalHeader header;
+    if (status.st_size < (off_t)sizeof(header)) {
+        // new, or cut short while it was being created: nothing logged yet
+        if (ftruncate(fd, 0) < 0 || writeHeader(fd, 0) < 0 || fsync(fd) < 0 ||
+            syncDir(path) < 0) {
+            close(fd);
+            return -1;
+        }
+        header.baseLsn = 0;
+    } else if (readAllAt(fd, &header, sizeof(header), 0) !=
+                   (ssize_t)sizeof(header) ||
+               memcmp(header.magic, WAL_MAGIC, sizeof(header.magic)) != 0 ||
+               header.crc != crc32c(&header, offsetof(WalHeader, crc))) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    wal->fd = fd;
+    wal->path = path;
+    wal->baseLsn = header.baseLsn;
+    wal->nextLsn = header.baseLsn + 1;
+    wal->size = sizeof(header);  // until replayWal() has looked
+    return 0;
+}
+
+void closeWal(Wal* wal) {
+    if (wal->fd < 0)
+        return;
+    close(wal->fd);
+    wal->fd = -1;
+}
+
+long replayWal(Wal* wal, uint32_t records,
+               void (*apply)(const WalEntry* entry, void* arg), void* arg) {
+    WalEntry* chunk = (WalEntry*)malloc(sizeof(WalEntry) * WAL_CHUNK);
+    if (chunk == NULL)
+        return -1;
+    off_t offset = sizeof(WalHeader);
+    uint64_t lsn = wal->baseLsn + 1;
+    bool valid = true;
+    while (valid) {
+        ssize_t n = readAllAt(wal->fd, chunk, sizeof(WalEntry) * WAL_CHUNK,
+                              offset);
+        if (n < 0) {
+            free(chunk);
+            return -1;
+        }
+        int len = n / sizeof(WalEntry);  // a torn entry at the end is cut
+        for (int i = 0; i < len; ++i, ++lsn, offset += sizeof(WalEntry)) {
+            WalEntry* entry = &chunk[i];
+            if (entry->lsn != lsn || entry->idx < 0 ||
+                (uint32_t)entry->idx >= records ||
+                entry->crc != crc32c(entry, offsetof(WalEntry, crc))) {
+                valid = false;
+                break;
+            }
+            apply(entry, arg);
+        }
+        if (len < WAL_CHUNK)
+            break;
+    }
+    free(chunk);
+
+    struct stat status;
+    if (fstat(wal->fd, &status) < 0)
+        return -1;
+    if (status.st_size > offset &&
+        (ftruncate(wal->fd, offset) < 0 || fdatasync(wal->fd) < 0))
+        return -1;
+    wal->size = offset;
+    wal->nextLsn = lsn;
+    return (long)(lsn - 1 - wal->baseLsn);
+}
+
+int appendWal(Wal* wal, WalEntry* entries, int n) {
+    for (int i = 0; i < n; ++i) {
+        entries[i].lsn = wal->nextLsn + i;
+        entries[i].reserved = 0;
+        entries[i].crc = crc32c(&entries[i], offsetof(WalEntry, crc));
+    }
+    size_t len = sizeof(WalEntry) * n;
+    if (writeAllAt(wal->fd, entries, len, wal->size) < 0) {
+        int err = errno;
+        if (ftruncate(wal->fd, wal->size) < 0) {
+            // what did get written must not be followed by the next append
+            close(wal->fd);
+            wal->fd = -1;
+        }
+        errno = err;
+        return -1;
+    }
+    wal->size += len;
+    wal->nextLsn += n;
+    return 0;
+}
+
+int compactWal(Wal* wal, uint64_t lsn) {
+    if (lsn <= wal->baseLsn)
+        return 0;
+    if (lsn >= wal->nextLsn) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t pathLen = strlen(wal->path);
+    char* tmpPath = (char*)malloc(pathLen + 5);
+    WalEntry* chunk = (WalEntry*)malloc(sizeof(WalEntry) * WAL_CHUNK);
+    if (tmpPath == NULL || chunk == NULL) {
+        free(tmpPath);
+        free(chunk);
+        return -1;
+    }
+    memcpy(tmpPath, wal->path, pathLen);
+    memcpy(tmpPath + pathLen, ".tmp", 5);
+
+    int fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int ret = fd < 0 || writeHeader(fd, lsn) < 0 ? -1 : 0;
+    // the entries after lsn keep their place relative to each other
+    off_t from = sizeof(WalHeader) + (off_t)(lsn - wal->baseLsn) *
+                                         sizeof(WalEntry),
+          to = sizeof(WalHeader);
+    while (ret == 0 && from < wal->size) {
+        size_t want = wal->size - from < (off_t)sizeof(WalEntry) * WAL_CHUNK
+                          ? (size_t)(wal->size - from)
+                          : sizeof(WalEntry) * WAL_CHUNK;
+        ssize_t n = readAllAt(wal->fd, chunk, want, from);
+        if (n != (ssize_t)want || writeAllAt(fd, chunk, want, to) < 0)
+            ret = -1;
+        from += want;
+        to += want;
+    }
+    if (ret == 0 && (fsync(fd) < 0 || rename(tmpPath, wal->path) < 0))
+        ret = -1;
+    if (ret < 0) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpPath);
+        }
+    } else {
+        close(wal->fd);
+        wal->fd = fd;
+        wal->baseLsn = lsn;
+        wal->size = to;
+        ret = syncDir(wal->path);
+    }
+    free(tmpPath);
+    free(chunk);
+    return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Append-only log of record images. Every committed order appends the whole
+// record after it, so replaying an entry twice is harmless. The file is a
+// WalHeader followed by WalEntry after WalEntry with consecutive sequence
+// numbers starting at baseLsn + 1; entries up to baseLsn are already in the
+// snapshot. Replay stops at the first entry that is torn, fails its checksum
+// or is out of sequence, and cuts the log there.
+#define WAL_MAGIC "csieWAL1"
+
+typedef struct {
+    char magic[8];
+    uint64_t baseLsn;  // the snapshot holds every entry up to this one
+    uint32_t reserved[3];
+    uint32_t crc;  // CRC-32C of the bytes before it
+} WalHeader;
+
+typedef struct {
+    uint64_t lsn;
+    int32_t idx;  // of the record in the snapshot
+    int32_t id;
+    int32_t adultMask;
+    int32_t childrenMask;
+    uint32_t reserved;
+    uint32_t crc;  // CRC-32C of the bytes before it
+} WalEntry;
+
+_Static_assert(sizeof(WalHeader) == 32, "WalHeader is 32 bytes on disk");
+_Static_assert(sizeof(WalEntry) == 32, "WalEntry is 32 bytes on disk");
+
+typedef struct {
+    int fd;  // -1 when closed
+    const char* path;
+    uint64_t baseLsn;
+    uint64_t nextLsn;  // of the next entry appended
+    off_t size;        // bytes of valid log
+} Wal;
+
+// Open the log at path, creating an empty one if there is none. Fails with
+// EINVAL if the header is not one of ours.
+int openWal(Wal* wal, const char* path);
+void closeWal(Wal* wal);
+// Call apply on every valid entry in order, and truncate whatever follows
+// them. An entry with idx >= records ends the log as a bad one would.
+// Returns the number of entries applied, -1 on error.
+long replayWal(Wal* wal, uint32_t records,
+               void (*apply)(const WalEntry* entry, void* arg), void* arg);
+// Number and checksum n entries and append them with one write. A failed
+// append is cut off again so the log stays valid. Not synced.
+int appendWal(Wal* wal, WalEntry* entries, int n);
+// Drop the entries up to lsn, now that the snapshot holds them: the rest is
+// copied to a new log which replaces this one, synced, through a rename.
+int compactWal(Wal* wal, uint64_t lsn);
+
+// entries in the log, which a replay would apply
+static inline uint64_t walEntries(const Wal* wal) {
+    return wal->nextLsn - 1 - wal->baseLsn;
+}
+
+#endif